@@ -0,0 +1,71 @@
+#ifndef _BENCHMARK_HPP
+#define _BENCHMARK_HPP
+
+// Machine-readable performance numbers shared by all of the renderers.
+// Every result is appended to the file as one JSON object per line, so
+// runs of different renderers and builds collect in one file that a
+// script can compare. Counters a renderer doesn't keep are 0, and the
+// rates derived from them are written as null.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <chrono>
+
+#define BENCHMARK_FILE "benchmark.json"
+
+uint64_t BenchmarkMicros() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// One full render
+struct RenderBenchmark {
+    const char *renderer;
+    int width, height;
+    float samples;        // Paths per pixel, on average for adaptive renders
+    double seconds;       // Wall time of the render, without writing the image
+    uint64_t rays;        // Marches, including shadow rays
+    uint64_t steps;       // March steps
+    uint64_t evaluations; // Distance function calls
+};
+
+// Writes value / over, or null if over is 0
+void AppendRate(FILE *fp, const char *name, double value, double over) {
+    if (over > 0) fprintf(fp, ", \"%s\": %.6g", name, value / over);
+    else fprintf(fp, ", \"%s\": null", name);
+}
+
+bool WriteBenchmark(const RenderBenchmark &b, const char *filename=BENCHMARK_FILE) {
+    FILE *fp = fopen(filename, "a");
+    if (!fp) {
+        printf("Failed to write %s.\n", filename);
+        return false;
+    }
+    fprintf(fp, "{\"renderer\": \"%s\", \"width\": %d, \"height\": %d, \"samples\": %g, \"seconds\": %.6f",
+        b.renderer, b.width, b.height, b.samples, b.seconds);
+    fprintf(fp, ", \"rays\": %llu, \"steps\": %llu, \"evaluations\": %llu",
+        (unsigned long long)b.rays, (unsigned long long)b.steps, (unsigned long long)b.evaluations);
+    AppendRate(fp, "rays_per_second", (double)b.rays, b.rays ? b.seconds : 0);
+    AppendRate(fp, "steps_per_ray", (double)b.steps, b.steps ? (double)b.rays : 0);
+    AppendRate(fp, "evaluations_per_second", (double)b.evaluations, b.evaluations ? b.seconds : 0);
+    fprintf(fp, "}\n");
+    fclose(fp);
+    return true;
+}
+
+// One microbenchmark: an operation timed over many iterations
+bool WriteMicroBenchmark(const char *name, uint64_t iterations, double seconds, const char *filename=BENCHMARK_FILE) {
+    FILE *fp = fopen(filename, "a");
+    if (!fp) {
+        printf("Failed to write %s.\n", filename);
+        return false;
+    }
+    fprintf(fp, "{\"benchmark\": \"%s\", \"iterations\": %llu, \"seconds\": %.6f",
+        name, (unsigned long long)iterations, seconds);
+    AppendRate(fp, "ns_per_op", seconds * 1e9, (double)iterations);
+    fprintf(fp, "}\n");
+    fclose(fp);
+    return true;
+}
+
+#endif // _BENCHMARK_HPP
@@ -0,0 +1,92 @@
+#ifndef _CHECKPOINT_HPP
+#define _CHECKPOINT_HPP
+
+// Render state saved to disk, so a long render that gets killed can go
+// on from where it was instead of starting over. A checkpoint is a short
+// header and then the renderer's state as raw sections: accumulated
+// radiance, sample counts, how far the render got. Samplers are counter
+// based, so that is all it takes to carry on with the same random
+// numbers.
+//
+// The header holds a key made from the settings the state depends on.
+// A checkpoint whose key or section sizes don't match is ignored. Saves
+// go to a temporary file that is renamed over the old checkpoint, so
+// being killed in the middle of one leaves the last checkpoint intact.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <initializer_list>
+#include <vector>
+
+#define CHECKPOINT_MAGIC 0x54504B43 // "CKPT"
+#define CHECKPOINT_VERSION 1
+
+struct CheckpointSection {
+    void *data;
+    size_t size;
+};
+
+// FNV-1a over the given values
+uint64_t CheckpointKey(std::initializer_list<uint64_t> values) {
+    uint64_t hash = 14695981039346656037ull;
+    for (uint64_t v : values) {
+        for (int i = 0; i < 8; i++) {
+            hash ^= (v >> (i * 8)) & 0xff;
+            hash *= 1099511628211ull;
+        }
+    }
+    return hash;
+}
+
+// Float settings go into a key as their bit pattern
+uint64_t CheckpointBits(float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+bool WriteCheckpoint(const char *filename, uint64_t key, const std::vector<CheckpointSection> &sections) {
+    char temporary[512];
+    snprintf(temporary, sizeof(temporary), "%s.tmp", filename);
+    FILE *fp = fopen(temporary, "wb");
+    if (!fp) return false;
+    uint32_t header[2] = { CHECKPOINT_MAGIC, CHECKPOINT_VERSION };
+    uint32_t count = sections.size();
+    bool ok = fwrite(header, sizeof(header), 1, fp) == 1 && fwrite(&key, sizeof(key), 1, fp) == 1 &&
+        fwrite(&count, sizeof(count), 1, fp) == 1;
+    for (const CheckpointSection &s : sections) {
+        uint64_t size = s.size;
+        ok = ok && fwrite(&size, sizeof(size), 1, fp) == 1 && fwrite(s.data, 1, s.size, fp) == s.size;
+    }
+    ok = fclose(fp) == 0 && ok;
+    return ok && rename(temporary, filename) == 0;
+}
+
+// Fills the sections from a checkpoint with the same key and layout.
+// Leaves them alone and returns false if there isn't one.
+bool ReadCheckpoint(const char *filename, uint64_t key, const std::vector<CheckpointSection> &sections) {
+    FILE *fp = fopen(filename, "rb");
+    if (!fp) return false;
+    uint32_t header[2], count;
+    uint64_t fileKey;
+    bool ok = fread(header, sizeof(header), 1, fp) == 1 && fread(&fileKey, sizeof(fileKey), 1, fp) == 1 &&
+        fread(&count, sizeof(count), 1, fp) == 1;
+    ok = ok && header[0] == CHECKPOINT_MAGIC && header[1] == CHECKPOINT_VERSION && fileKey == key && count == sections.size();
+    // Everything is read before any section is touched, so a truncated
+    // file can't leave the state half loaded
+    std::vector<std::vector<unsigned char>> data(sections.size());
+    for (size_t i = 0; ok && i < sections.size(); i++) {
+        uint64_t size;
+        ok = fread(&size, sizeof(size), 1, fp) == 1 && size == sections[i].size;
+        if (!ok) break;
+        data[i].resize(size);
+        ok = fread(data[i].data(), 1, size, fp) == size;
+    }
+    fclose(fp);
+    if (!ok) return false;
+    for (size_t i = 0; i < sections.size(); i++) memcpy(sections[i].data, data[i].data(), sections[i].size);
+    return true;
+}
+
+#endif // _CHECKPOINT_HPP
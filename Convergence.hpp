@@ -0,0 +1,164 @@
+#ifndef _CONVERGENCE_HPP
+#define _CONVERGENCE_HPP
+
+// Equal-time convergence test shared by the renderers. Throughput alone
+// doesn't say whether a sampling change pays off, since a slower path
+// can still reach a clean image sooner. So the renderer first makes a
+// reference with many samples per pixel, or loads the one it saved
+// before, and then renders in small batches. After every batch the
+// error of its image against the reference is recorded along with the
+// render time so far.
+//
+// The points are written to CONVERGENCE_PREFIX<renderer>.json, one JSON
+// object per line, ready to plot as error against time. If
+// CONVERGENCE_PREFIX<renderer>.baseline.json exists, usually an earlier
+// run's output copied aside, every point whose error is more than
+// CONVERGENCE_TOLERANCE above the baseline's at the same time counts as
+// a regression. Delete the reference after changing the scene.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <math.h>
+#include <vector>
+#include "Image.hpp"
+#include "Benchmark.hpp"
+
+#define CONVERGENCE_PREFIX "convergence_"
+#define CONVERGENCE_REFERENCE_PREFIX "reference_"
+#define CONVERGENCE_TOLERANCE 0.1
+
+struct ConvergencePoint {
+    double seconds; // Render time, without the reference and the error measurements
+    float samples;  // Paths per pixel, on average for adaptive renders
+    double rmse;
+    double relMse;  // Squared error relative to the reference's square
+};
+
+// Error of image against reference over every channel of every pixel
+void ImageError(const float *image, const float *reference, int width, int height, ConvergencePoint &point) {
+    size_t count = (size_t)width * height * 3;
+    double squared = 0, relative = 0;
+    for (size_t i = 0; i < count; i++) {
+        double d = image[i] - reference[i];
+        squared += d * d;
+        // The constant keeps dark pixels from dominating
+        relative += d * d / ((double)reference[i] * reference[i] + 1e-2);
+    }
+    point.rmse = sqrt(squared / count);
+    point.relMse = relative / count;
+}
+
+bool WriteConvergence(const char *filename, const char *renderer, const std::vector<ConvergencePoint> &points) {
+    FILE *fp = fopen(filename, "w");
+    if (!fp) return false;
+    for (const ConvergencePoint &p : points) {
+        fprintf(fp, "{\"renderer\": \"%s\", \"seconds\": %.6f, \"samples\": %g, \"rmse\": %.9g, \"relmse\": %.9g}\n",
+            renderer, p.seconds, p.samples, p.rmse, p.relMse);
+    }
+    return fclose(fp) == 0;
+}
+
+// Reads back what WriteConvergence wrote
+bool ReadConvergence(const char *filename, std::vector<ConvergencePoint> &points) {
+    FILE *fp = fopen(filename, "r");
+    if (!fp) return false;
+    char line[512];
+    while (fgets(line, sizeof(line), fp)) {
+        ConvergencePoint p;
+        if (sscanf(line, "{\"renderer\": \"%*[^\"]\", \"seconds\": %lf, \"samples\": %f, \"rmse\": %lf, \"relmse\": %lf",
+            &p.seconds, &p.samples, &p.rmse, &p.relMse) == 4) {
+            points.push_back(p);
+        }
+    }
+    fclose(fp);
+    return true;
+}
+
+// Error of the baseline at the given time, interpolated between its
+// points on log-log axes, where error falls off along a straight line.
+// False outside of the times the baseline covers.
+bool BaselineError(const std::vector<ConvergencePoint> &baseline, double seconds, ConvergencePoint &error) {
+    for (size_t i = 1; i < baseline.size(); i++) {
+        const ConvergencePoint &a = baseline[i - 1], &b = baseline[i];
+        if (seconds < a.seconds || seconds > b.seconds || a.seconds <= 0) continue;
+        double t = b.seconds > a.seconds ? log(seconds / a.seconds) / log(b.seconds / a.seconds) : 0;
+        error.seconds = seconds;
+        error.rmse = a.rmse * pow(b.rmse / a.rmse, t);
+        error.relMse = a.relMse * pow(b.relMse / a.relMse, t);
+        return true;
+    }
+    return false;
+}
+
+// Prints every point that converged worse than the baseline and returns
+// how many there were
+int CompareConvergence(const std::vector<ConvergencePoint> &points, const std::vector<ConvergencePoint> &baseline) {
+    int regressions = 0, compared = 0;
+    for (const ConvergencePoint &p : points) {
+        ConvergencePoint base;
+        if (!BaselineError(baseline, p.seconds, base)) continue;
+        compared++;
+        // relMSE is squared, so its tolerance is too
+        bool worse = p.rmse > base.rmse * (1 + CONVERGENCE_TOLERANCE) ||
+            p.relMse > base.relMse * (1 + CONVERGENCE_TOLERANCE) * (1 + CONVERGENCE_TOLERANCE);
+        if (!worse) continue;
+        printf("Regression at %.3f seconds: RMSE %g, relMSE %g, baseline %g and %g.\n",
+            p.seconds, p.rmse, p.relMse, base.rmse, base.relMse);
+        regressions++;
+    }
+    printf("%d of %d points worse than the baseline.\n", regressions, compared);
+    return regressions;
+}
+
+// Runs the test for seconds of render time and returns the number of
+// regressions against the baseline. reference(rgb) renders the
+// reference into rgb. batch(rgb) renders the next batch, puts the image
+// so far into rgb and returns its paths per pixel, or 0 once it can't
+// improve it any further. Both use float RGB framebuffers with rows top
+// to bottom, and the reference must not use the same random numbers as
+// the batches.
+template<class Reference, class Batch>
+int RunConvergence(const char *renderer, int width, int height, double seconds, Reference reference, Batch batch) {
+    char filename[256];
+    std::vector<float> target, image((size_t)width * height * 3);
+    snprintf(filename, sizeof(filename), CONVERGENCE_REFERENCE_PREFIX "%s.pfm", renderer);
+    int referenceWidth, referenceHeight;
+    if (ReadPFM(filename, target, referenceWidth, referenceHeight) && referenceWidth == width && referenceHeight == height) {
+        printf("Loaded reference from %s.\n", filename);
+    } else {
+        target.assign(image.size(), 0);
+        uint64_t start = BenchmarkMicros();
+        reference(target.data());
+        printf("Rendered reference in %f seconds.\n", (BenchmarkMicros() - start) / 1e6);
+        if (!WritePFM(filename, target.data(), width, height)) printf("Failed to write %s.\n", filename);
+    }
+
+    std::vector<ConvergencePoint> points;
+    printf("  %10s %10s %12s %12s\n", "seconds", "samples", "RMSE", "relMSE");
+    for (double elapsed = 0; elapsed < seconds;) {
+        uint64_t start = BenchmarkMicros();
+        float samples = batch(image.data());
+        elapsed += (BenchmarkMicros() - start) / 1e6;
+        if (samples <= 0) break;
+
+        ConvergencePoint p;
+        p.seconds = elapsed;
+        p.samples = samples;
+        ImageError(image.data(), target.data(), width, height, p);
+        printf("  %10.3f %10.2f %12.6g %12.6g\n", p.seconds, p.samples, p.rmse, p.relMse);
+        points.push_back(p);
+    }
+
+    snprintf(filename, sizeof(filename), CONVERGENCE_PREFIX "%s.json", renderer);
+    if (!WriteConvergence(filename, renderer, points)) printf("Failed to write %s.\n", filename);
+
+    std::vector<ConvergencePoint> baseline;
+    snprintf(filename, sizeof(filename), CONVERGENCE_PREFIX "%s.baseline.json", renderer);
+    if (!ReadConvergence(filename, baseline)) {
+        printf("No baseline in %s, nothing to compare with.\n", filename);
+        return 0;
+    }
+    return CompareConvergence(points, baseline);
+}
+
+#endif // _CONVERGENCE_HPP
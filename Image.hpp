@@ -0,0 +1,428 @@
+#ifndef _IMAGE_HPP
+#define _IMAGE_HPP
+
+// Image output shared by all of the renderers. Every encoder works from
+// a contiguous framebuffer (8-bit RGB, or float RGB for the HDR formats)
+// with rows top to bottom, builds the file in memory and hands it to the
+// OS in a single write.
+//
+// WriteImage picks the format from the file extension:
+//   .ppm - binary NetPPM (P6)
+//   .png - 8-bit RGB PNG, deflated in parallel stripes
+//   .pfm - float Portable FloatMap
+//   .exr - uncompressed float OpenEXR
+// 8-bit framebuffers can only go to .ppm and .png, float ones to .pfm
+// and .exr. ReadPFM loads the PFM files written here back in.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <thread>
+#include <vector>
+
+typedef std::vector<unsigned char> ImageBytes;
+
+bool WriteBytes(const char *filename, const ImageBytes &bytes) {
+    FILE *fp = fopen(filename, "wb");
+    if (!fp) return false;
+    size_t written = fwrite(bytes.data(), 1, bytes.size(), fp);
+    return fclose(fp) == 0 && written == bytes.size();
+}
+
+void AppendBytes(ImageBytes &out, const void *data, size_t size) {
+    const unsigned char *p = (const unsigned char *)data;
+    out.insert(out.end(), p, p + size);
+}
+
+bool WritePPM(const char *filename, const unsigned char *rgb, int width, int height) {
+    // The framebuffer already is the PPM body, so it is written in place
+    FILE *fp = fopen(filename, "wb");
+    if (!fp) return false;
+    size_t size = (size_t)width * height * 3;
+    fprintf(fp, "P6 %d %d 255\n", width, height);
+    size_t written = fwrite(rgb, 1, size, fp);
+    return fclose(fp) == 0 && written == size;
+}
+
+bool WritePFM(const char *filename, const float *rgb, int width, int height) {
+    char header[64];
+    // Negative scale marks the data as little-endian
+    int headerSize = snprintf(header, sizeof(header), "PF\n%d %d\n-1.0\n", width, height);
+    ImageBytes out;
+    out.reserve(headerSize + (size_t)width * height * 12);
+    AppendBytes(out, header, headerSize);
+    // PFM rows go bottom to top
+    for (int y = height; y--;) {
+        AppendBytes(out, rgb + (size_t)y * width * 3, (size_t)width * 12);
+    }
+    return WriteBytes(filename, out);
+}
+
+// Reads a little-endian RGB PFM, as WritePFM writes them, into a
+// framebuffer with rows top to bottom
+bool ReadPFM(const char *filename, std::vector<float> &rgb, int &width, int &height) {
+    FILE *fp = fopen(filename, "rb");
+    if (!fp) return false;
+    float scale;
+    bool ok = fscanf(fp, "PF %d %d %f", &width, &height, &scale) == 3 && scale < 0 && width > 0 && height > 0;
+    // Exactly one whitespace character ends the header
+    if (ok) ok = fgetc(fp) != EOF;
+    if (ok) {
+        rgb.resize((size_t)width * height * 3);
+        for (int y = height; ok && y--;) {
+            ok = fread(&rgb[(size_t)y * width * 3], 12, width, fp) == (size_t)width;
+        }
+    }
+    fclose(fp);
+    return ok;
+}
+
+// OpenEXR header attribute: name, type, size, value
+void AppendExrAttribute(ImageBytes &out, const char *name, const char *type, const void *value, int32_t size) {
+    AppendBytes(out, name, strlen(name) + 1);
+    AppendBytes(out, type, strlen(type) + 1);
+    AppendBytes(out, &size, 4);
+    AppendBytes(out, value, size);
+}
+
+bool WriteEXR(const char *filename, const float *rgb, int width, int height) {
+    ImageBytes out;
+    const unsigned char magic[8] = { 0x76, 0x2f, 0x31, 0x01, 2, 0, 0, 0 };
+    AppendBytes(out, magic, 8);
+
+    // Channels are stored in alphabetical order
+    ImageBytes channels;
+    const char *names[3] = { "B", "G", "R" };
+    for (int c = 0; c < 3; c++) {
+        // pixel type FLOAT, pLinear + reserved, x and y sampling
+        const int32_t info[4] = { 2, 0, 1, 1 };
+        AppendBytes(channels, names[c], 2);
+        AppendBytes(channels, info, 16);
+    }
+    channels.push_back(0);
+    AppendExrAttribute(out, "channels", "chlist", channels.data(), channels.size());
+
+    const unsigned char noCompression = 0, increasingY = 0;
+    const int32_t window[4] = { 0, 0, width - 1, height - 1 };
+    const float one = 1, center[2] = { 0, 0 };
+    AppendExrAttribute(out, "compression", "compression", &noCompression, 1);
+    AppendExrAttribute(out, "dataWindow", "box2i", window, 16);
+    AppendExrAttribute(out, "displayWindow", "box2i", window, 16);
+    AppendExrAttribute(out, "lineOrder", "lineOrder", &increasingY, 1);
+    AppendExrAttribute(out, "pixelAspectRatio", "float", &one, 4);
+    AppendExrAttribute(out, "screenWindowCenter", "v2f", center, 8);
+    AppendExrAttribute(out, "screenWindowWidth", "float", &one, 4);
+    out.push_back(0);
+
+    // Offset table, then one uncompressed scanline per chunk
+    const int32_t lineSize = width * 12;
+    uint64_t offset = out.size() + (uint64_t)height * 8;
+    for (int y = 0; y < height; y++) {
+        AppendBytes(out, &offset, 8);
+        offset += 8 + lineSize;
+    }
+    std::vector<float> line(width);
+    for (int32_t y = 0; y < height; y++) {
+        AppendBytes(out, &y, 4);
+        AppendBytes(out, &lineSize, 4);
+        const float *row = rgb + (size_t)y * width * 3;
+        for (int c = 3; c--;) {
+            for (int x = 0; x < width; x++) line[x] = row[x * 3 + c];
+            AppendBytes(out, line.data(), width * 4);
+        }
+    }
+    return WriteBytes(filename, out);
+}
+
+// ---- PNG ----
+
+uint32_t Crc32(const unsigned char *data, size_t size, uint32_t crc=0) {
+    static uint32_t table[256];
+    static bool tableReady = false;
+    if (!tableReady) {
+        for (uint32_t n = 0; n < 256; n++) {
+            uint32_t c = n;
+            for (int k = 0; k < 8; k++) c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+            table[n] = c;
+        }
+        tableReady = true;
+    }
+    crc = ~crc;
+    for (size_t i = 0; i < size; i++) crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+uint32_t Adler32(const unsigned char *data, size_t size) {
+    uint32_t a = 1, b = 0;
+    while (size > 0) {
+        // Largest run that cannot overflow b before the modulo
+        size_t run = size < 5552 ? size : 5552;
+        size -= run;
+        while (run--) {
+            a += *data++;
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+    }
+    return b << 16 | a;
+}
+
+void AppendBigEndian(ImageBytes &out, uint32_t v) {
+    const unsigned char b[4] = { (unsigned char)(v >> 24), (unsigned char)(v >> 16), (unsigned char)(v >> 8), (unsigned char)v };
+    AppendBytes(out, b, 4);
+}
+
+void AppendPngChunk(ImageBytes &out, const char *type, const unsigned char *data, size_t size) {
+    AppendBigEndian(out, size);
+    size_t start = out.size();
+    AppendBytes(out, type, 4);
+    AppendBytes(out, data, size);
+    AppendBigEndian(out, Crc32(out.data() + start, size + 4));
+}
+
+// Writes deflate bits least significant first
+struct BitWriter {
+    ImageBytes bytes;
+    uint64_t buffer = 0;
+    int count = 0;
+
+    void write(uint32_t bits, int n) {
+        buffer |= (uint64_t)bits << count;
+        count += n;
+        if (count >= 32) {
+            AppendBytes(bytes, &buffer, 4);
+            buffer >>= 32;
+            count -= 32;
+        }
+    }
+    void align() {
+        if (count % 8) write(0, 8 - count % 8);
+        while (count > 0) {
+            bytes.push_back(buffer & 0xff);
+            buffer >>= 8;
+            count -= 8;
+        }
+    }
+};
+
+uint32_t ReverseBits(uint32_t code, int n) {
+    uint32_t reversed = 0;
+    for (int i = 0; i < n; i++) reversed |= ((code >> i) & 1) << (n - 1 - i);
+    return reversed;
+}
+
+// Fixed Huffman code of a literal/length symbol, already bit-reversed
+struct FixedCode {
+    uint16_t bits;
+    uint8_t length;
+};
+
+const FixedCode *FixedLiteralCodes() {
+    static FixedCode codes[288];
+    static bool ready = false;
+    if (!ready) {
+        for (int s = 0; s < 288; s++) {
+            if (s < 144) codes[s] = { (uint16_t)ReverseBits(0x30 + s, 8), 8 };
+            else if (s < 256) codes[s] = { (uint16_t)ReverseBits(0x190 + s - 144, 9), 9 };
+            else if (s < 280) codes[s] = { (uint16_t)ReverseBits(s - 256, 7), 7 };
+            else codes[s] = { (uint16_t)ReverseBits(0xc0 + s - 280, 8), 8 };
+        }
+        ready = true;
+    }
+    return codes;
+}
+
+void DeflateLiteral(BitWriter &bits, const FixedCode *codes, int symbol) {
+    bits.write(codes[symbol].bits, codes[symbol].length);
+}
+
+void DeflateMatch(BitWriter &bits, const FixedCode *codes, int length, int distance) {
+    static const int lengthBase[29] = {
+        3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+        35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+    };
+    static const int lengthExtra[29] = {
+        0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+        3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+    };
+    static const int distanceBase[30] = {
+        1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+        257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+    };
+    static const int distanceExtra[30] = {
+        0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+        7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+    };
+
+    int l = 28;
+    while (lengthBase[l] > length) l--;
+    DeflateLiteral(bits, codes, 257 + l);
+    bits.write(length - lengthBase[l], lengthExtra[l]);
+
+    int d = 29;
+    while (distanceBase[d] > distance) d--;
+    bits.write(ReverseBits(d, 5), 5);
+    bits.write(distance - distanceBase[d], distanceExtra[d]);
+}
+
+// Compresses one stripe into fixed-Huffman deflate blocks with greedy
+// LZ77 matching. Stripes never reference each other, so a non-final
+// stripe ends with an empty stored block to byte-align it and the
+// stripes can simply be concatenated into one stream.
+ImageBytes DeflateStripe(const unsigned char *data, size_t size, bool last, const FixedCode *codes) {
+    const int hashBits = 15;
+    const int window = 32768;
+    const int maxChain = 4;
+    std::vector<int> head(1 << hashBits, -1);
+    // Chains only need to reach back one window, so prev is a ring
+    std::vector<int> prev(window);
+
+    BitWriter bits;
+    bits.bytes.reserve(size / 2);
+    bits.write(last ? 1 : 0, 1);
+    bits.write(1, 2); // fixed Huffman
+
+    auto hash = [&](size_t i) {
+        return ((data[i] << 10) ^ (data[i + 1] << 5) ^ data[i + 2]) & ((1 << hashBits) - 1);
+    };
+
+    size_t i = 0;
+    while (i < size) {
+        int bestLength = 0, bestDistance = 0;
+        if (i + 3 <= size) {
+            int h = hash(i);
+            int candidate = head[h];
+            for (int chain = 0; candidate >= 0 && i - candidate <= (size_t)window && chain < maxChain; chain++) {
+                int maxLength = size - i < 258 ? size - i : 258;
+                // Cannot beat the current best unless it matches one byte further
+                if (bestLength > 0 && (bestLength >= maxLength || data[candidate + bestLength] != data[i + bestLength])) {
+                    candidate = prev[candidate & (window - 1)];
+                    continue;
+                }
+                int length = 0;
+                while (length < maxLength && data[candidate + length] == data[i + length]) length++;
+                if (length > bestLength) {
+                    bestLength = length;
+                    bestDistance = i - candidate;
+                    if (length == maxLength) break;
+                }
+                candidate = prev[candidate & (window - 1)];
+            }
+            prev[i & (window - 1)] = head[h];
+            head[h] = i;
+        }
+
+        if (bestLength >= 3) {
+            DeflateMatch(bits, codes, bestLength, bestDistance);
+            // Keep the hash chains up to date through the match
+            for (size_t j = i + 1; j < i + bestLength && j + 3 <= size; j++) {
+                int h = hash(j);
+                prev[j & (window - 1)] = head[h];
+                head[h] = j;
+            }
+            i += bestLength;
+        } else {
+            DeflateLiteral(bits, codes, data[i]);
+            i++;
+        }
+    }
+    DeflateLiteral(bits, codes, 256); // end of block
+
+    if (!last) {
+        // Empty stored block: BFINAL 0, BTYPE 00, LEN 0, NLEN 0xffff
+        bits.write(0, 3);
+        bits.align();
+        const unsigned char empty[4] = { 0, 0, 0xff, 0xff };
+        AppendBytes(bits.bytes, empty, 4);
+    }
+    bits.align();
+    return bits.bytes;
+}
+
+unsigned char PaethPredictor(int a, int b, int c) {
+    int p = a + b - c;
+    int pa = p > a ? p - a : a - p;
+    int pb = p > b ? p - b : b - p;
+    int pc = p > c ? p - c : c - p;
+    if (pa <= pb && pa <= pc) return a;
+    if (pb <= pc) return b;
+    return c;
+}
+
+bool WritePNG(const char *filename, const unsigned char *rgb, int width, int height) {
+    const size_t stride = (size_t)width * 3;
+    const size_t rowSize = stride + 1;
+
+    int threads = std::thread::hardware_concurrency();
+    if (threads < 1) threads = 1;
+    if (threads > height) threads = height;
+
+    // Every row uses the Paeth filter
+    ImageBytes filtered(rowSize * height);
+    const FixedCode *codes = FixedLiteralCodes();
+    std::vector<ImageBytes> stripes(threads);
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; t++) {
+        workers.emplace_back([&, t]() {
+            int y0 = (int64_t)height * t / threads;
+            int y1 = (int64_t)height * (t + 1) / threads;
+            for (int y = y0; y < y1; y++) {
+                const unsigned char *row = rgb + y * stride;
+                const unsigned char *up = y > 0 ? row - stride : NULL;
+                unsigned char *out = filtered.data() + y * rowSize;
+                out[0] = 4;
+                for (size_t x = 0; x < stride; x++) {
+                    int a = x >= 3 ? row[x - 3] : 0;
+                    int b = up ? up[x] : 0;
+                    int c = up && x >= 3 ? up[x - 3] : 0;
+                    out[x + 1] = row[x] - PaethPredictor(a, b, c);
+                }
+            }
+            stripes[t] = DeflateStripe(filtered.data() + y0 * rowSize, (y1 - y0) * rowSize, t == threads - 1, codes);
+        });
+    }
+    for (auto &w : workers) w.join();
+
+    ImageBytes out;
+    const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    AppendBytes(out, signature, 8);
+
+    ImageBytes header;
+    AppendBigEndian(header, width);
+    AppendBigEndian(header, height);
+    // 8 bits per channel, RGB, deflate, adaptive filtering, no interlace
+    const unsigned char format[5] = { 8, 2, 0, 0, 0 };
+    AppendBytes(header, format, 5);
+    AppendPngChunk(out, "IHDR", header.data(), header.size());
+
+    // zlib stream split across one IDAT chunk per stripe
+    const unsigned char zlibHeader[2] = { 0x78, 0x01 };
+    ImageBytes first(zlibHeader, zlibHeader + 2);
+    AppendBytes(first, stripes[0].data(), stripes[0].size());
+    stripes[0].swap(first);
+    AppendBigEndian(stripes[threads - 1], Adler32(filtered.data(), filtered.size()));
+    for (auto &stripe : stripes) AppendPngChunk(out, "IDAT", stripe.data(), stripe.size());
+
+    AppendPngChunk(out, "IEND", NULL, 0);
+    return WriteBytes(filename, out);
+}
+
+bool HasExtension(const char *filename, const char *extension) {
+    size_t n = strlen(filename), e = strlen(extension);
+    return n >= e && strcmp(filename + n - e, extension) == 0;
+}
+
+// Writes an 8-bit RGB framebuffer as .png or .ppm
+bool WriteImage(const char *filename, const unsigned char *rgb, int width, int height) {
+    if (HasExtension(filename, ".png")) return WritePNG(filename, rgb, width, height);
+    return WritePPM(filename, rgb, width, height);
+}
+
+// Writes a float RGB framebuffer as .exr or .pfm
+bool WriteImage(const char *filename, const float *rgb, int width, int height) {
+    if (HasExtension(filename, ".exr")) return WriteEXR(filename, rgb, width, height);
+    return WritePFM(filename, rgb, width, height);
+}
+
+#endif // _IMAGE_HPP
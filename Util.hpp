@@ -1,6 +1,7 @@
 #ifndef _UTIL_HPP
 
 #include <math.h>
+#include <stdint.h>
 
 struct Vec {
     float x, y, z;
@@ -63,36 +64,64 @@ void GetTangents(Vec normal, Vec &tangent, Vec &bitangent) {
 }
 
 typedef float (*DistanceEstimator)(Vec, int&);
+// Enhanced sphere tracing: steps are over-relaxed by this factor and
+// fall back to plain sphere tracing once one overshoots
+#define MARCH_RELAXATION 1.6
+
+uint64_t marchedRays = 0;
+uint64_t marchedSteps = 0;
+uint64_t marchEvaluations = 0; // Calls to the distance estimator
+uint64_t cappedRays = 0; // Rays that used up their step budget
+
 RayHit RayMarch(Ray ray, DistanceEstimator estimator, float maxDist=100) {
     float d = 0;
     float minDist = 1e9;
-    int noHitCount = 0;
+    int unused = 0;
     int hitType = 0;
     int steps = 0;
-    float totalD;
-    for (totalD = 0; totalD < maxDist; totalD += d) {
+    float totalD = 0;
+    float relaxation = MARCH_RELAXATION;
+    float lastDist = 0;
+    float lastStep = 0;
+    marchedRays++;
+    while (totalD < maxDist) {
         steps += 1;
+        marchedSteps++;
+        marchEvaluations++;
         Vec hitPoint = ray.origin + ray.direction * totalD;
         d = estimator(hitPoint, hitType);
-        minDist = min(minDist, d);
-        totalD += d;
-        if (d < 0.01) {
-            Vec hitNorm = !(Vec(
-                estimator(hitPoint + Vec(0.01, 0), noHitCount) - d,
-                estimator(hitPoint + Vec(0, 0.01), noHitCount) - d,
-                estimator(hitPoint + Vec(0, 0, 0.01), noHitCount) - d
-            ));
-            return {
-                ray,
-                hitPoint,
-                hitNorm,
-                hitType,
-                steps,
-                totalD,
-                d,
-                minDist
-            };
-        } else if (++noHitCount > 99) break;
+        if (relaxation > 1 && fabsf(d) + lastDist < lastStep) {
+            totalD += lastDist - lastStep;
+            lastStep = lastDist;
+            relaxation = 1;
+        } else {
+            minDist = min(minDist, d);
+            if (d < 0.01) {
+                Vec hitNorm = !(Vec(
+                    estimator(hitPoint + Vec(0.01, 0), unused) - d,
+                    estimator(hitPoint + Vec(0, 0.01), unused) - d,
+                    estimator(hitPoint + Vec(0, 0, 0.01), unused) - d
+                ));
+                marchEvaluations += 3;
+                return {
+                    ray,
+                    hitPoint,
+                    hitNorm,
+                    hitType,
+                    steps,
+                    totalD,
+                    d,
+                    minDist
+                };
+            }
+            lastDist = d;
+            lastStep = d * relaxation;
+            totalD += lastStep;
+        }
+        if (steps > 99) {
+            cappedRays++;
+            break;
+        }
     }
     return { ray, ray.origin, 0, 0, steps, totalD, d, minDist };
 }
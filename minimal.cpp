@@ -1,6 +1,8 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include "Util.hpp"
+#include "Image.hpp"
+#include "Benchmark.hpp"
 
 #define BOUNCE_COUNT 4
 #define SAMPLES 1
@@ -18,7 +20,6 @@ struct Camera {
     Vec right;
     Vec up;
 };
-float random() { return (float)rand() / RAND_MAX; }
 
 // Get distance to closest object (negative means inside)
 float QueryDistance(Vec p, int &hitType) {
@@ -103,23 +104,27 @@ int main() {
         position, forward, right, up
     };
 
-    FILE *fp;
-    if (fopen_s(&fp, FILENAME, "wb") != 0) {
-        printf("Failed to open file");
-        return -1;
-    }
-    fprintf(fp, "P6 %d %d 255\n", WIDTH, HEIGHT);
-
+    static unsigned char pixels[WIDTH * HEIGHT * 3];
+    uint64_t start = BenchmarkMicros();
     for (int y = 0; y < HEIGHT; y++) {
         for (int x = WIDTH; x--;) {
             Vec luminance = Luminance(x, y, &camera, SAMPLES);
             Vec color = (luminance * 255).limit(255);
-            fprintf(fp, "%c%c%c", (int)color.x, (int)color.y, (int)color.z);
+            int i = (y * WIDTH + (WIDTH - 1 - x)) * 3;
+            pixels[i] = (int)color.x;
+            pixels[i + 1] = (int)color.y;
+            pixels[i + 2] = (int)color.z;
         }
     }
-    fclose(fp);
+    uint64_t end = BenchmarkMicros();
+    if (!WriteImage(FILENAME, pixels, WIDTH, HEIGHT)) {
+        printf("Failed to write file");
+        return -1;
+    }
 
-    printf("Output to %s", FILENAME);
+    printf("Output to %s\n", FILENAME);
+    printf("Marched %llu rays, %llu hit the step cap", (unsigned long long)marchedRays, (unsigned long long)cappedRays);
+    WriteBenchmark({ "minimal", WIDTH, HEIGHT, SAMPLES, (end - start) / 1e6, marchedRays, marchedSteps, marchEvaluations });
 
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,141 @@
+#ifndef _BSDF_H
+#define _BSDF_H
+
+#include <math.h>
+#include "Vector.hpp"
+
+// Scattering functions with importance sampling. Every BSDF works in the
+// local frame of the surface, where the normal is +z, and takes wo as
+// the direction back towards where the ray came from. Sampling takes its
+// random numbers as arguments so any Sampler can drive it without
+// allocating.
+//
+//   sample(frame, wo, u1, u2)  picks wi in proportion to the BSDF
+//   evaluate(frame, wo, wi)    f(wo, wi) * cos(wi), for light sampling
+//   pdf(frame, wo, wi)         density sample() picks wi with
+
+#define BSDF_PI 3.14159265f
+
+// Picked direction along with the weight f * cos / pdf that the light
+// coming from it is multiplied by. A weight of 0 means the sample
+// didn't leave the surface and the path should end.
+struct BsdfSample {
+    Vector direction;
+    Vector weight;
+    float pdf;
+};
+
+// Orthonormal basis around a unit normal (Duff et al. 2017)
+struct Frame {
+    Vector tangent, bitangent, normal;
+
+    Frame(Vector n) : normal(n) {
+        float sign = copysignf(1, n.z);
+        float a = -1 / (sign + n.z);
+        float b = n.x * n.y * a;
+        tangent = Vector(1 + sign * n.x * n.x * a, sign * b, -sign * n.x);
+        bitangent = Vector(b, sign + n.y * n.y * a, -n.y);
+    }
+
+    Vector toLocal(Vector v) const {
+        return Vector(v % tangent, v % bitangent, v % normal);
+    }
+    Vector toWorld(Vector v) const {
+        return tangent * v.x + bitangent * v.y + normal * v.z;
+    }
+};
+
+// Ideal diffuse reflection, sampled with a cosine-weighted hemisphere
+struct Lambert {
+    Vector albedo;
+
+    BsdfSample sample(const Frame &frame, Vector /*wo*/, float u1, float u2) const {
+        float r = sqrtf(u1);
+        float phi = 2 * BSDF_PI * u2;
+        Vector wi(r * cosf(phi), r * sinf(phi), sqrtf(fmaxf(0, 1 - u1)));
+        return { frame.toWorld(wi), albedo, wi.z / BSDF_PI };
+    }
+
+    Vector evaluate(const Frame &frame, Vector /*wo*/, Vector wi) const {
+        float cosine = wi % frame.normal;
+        return cosine > 0 ? albedo * (cosine / BSDF_PI) : Vector(0);
+    }
+
+    float pdf(const Frame &frame, Vector /*wo*/, Vector wi) const {
+        return fmaxf(0, wi % frame.normal) / BSDF_PI;
+    }
+};
+
+// Rough conductor with the GGX microfacet distribution, Smith shadowing
+// and Schlick's Fresnel. Samples the distribution of normals visible
+// from wo (Heitz 2018), so no samples are wasted on facets that face
+// away and the weight stays close to the Fresnel term.
+struct Ggx {
+    Vector reflectance; // At normal incidence
+    float alpha;        // Roughness, the square of the perceptual one
+
+    BsdfSample sample(const Frame &frame, Vector wo, float u1, float u2) const {
+        Vector o = frame.toLocal(wo);
+        if (o.z <= 0) return { frame.normal, Vector(0), 0 };
+
+        // Stretch the view direction into the hemisphere configuration
+        Vector vh = !Vector(alpha * o.x, alpha * o.y, o.z);
+        float lengthSq = vh.x * vh.x + vh.y * vh.y;
+        Vector t1 = lengthSq > 0 ? Vector(-vh.y, vh.x, 0) / sqrtf(lengthSq) : Vector(1, 0, 0);
+        Vector t2 = vh.cross(t1);
+
+        // Point on the projected half disk
+        float r = sqrtf(u1);
+        float phi = 2 * BSDF_PI * u2;
+        float p1 = r * cosf(phi);
+        float p2 = r * sinf(phi);
+        float s = 0.5f * (1 + vh.z);
+        p2 = (1 - s) * sqrtf(1 - p1 * p1) + s * p2;
+
+        // Back to the ellipsoid configuration
+        Vector nh = t1 * p1 + t2 * p2 + vh * sqrtf(fmaxf(0, 1 - p1 * p1 - p2 * p2));
+        Vector h = !Vector(alpha * nh.x, alpha * nh.y, fmaxf(1e-6f, nh.z));
+
+        float oh = o % h;
+        Vector i = h * (2 * oh) - o;
+        if (i.z <= 0) return { frame.toWorld(i), Vector(0), 0 };
+
+        Vector weight = fresnel(oh) * (smith(o, i) / smithView(o));
+        return { frame.toWorld(i), weight, smithView(o) * distribution(h) / (4 * o.z) };
+    }
+
+    Vector evaluate(const Frame &frame, Vector wo, Vector wi) const {
+        Vector o = frame.toLocal(wo), i = frame.toLocal(wi);
+        if (o.z <= 0 || i.z <= 0) return Vector(0);
+        Vector h = !(o + i);
+        return fresnel(o % h) * (distribution(h) * smith(o, i) / (4 * o.z));
+    }
+
+    float pdf(const Frame &frame, Vector wo, Vector wi) const {
+        Vector o = frame.toLocal(wo), i = frame.toLocal(wi);
+        if (o.z <= 0 || i.z <= 0) return 0;
+        Vector h = !(o + i);
+        return smithView(o) * distribution(h) / (4 * o.z);
+    }
+
+private:
+    float distribution(Vector h) const {
+        float a2 = alpha * alpha;
+        float t = h.z * h.z * (a2 - 1) + 1;
+        return a2 / (BSDF_PI * t * t);
+    }
+    float lambda(Vector v) const {
+        float t2 = (v.x * v.x + v.y * v.y) / (v.z * v.z);
+        return (sqrtf(1 + alpha * alpha * t2) - 1) / 2;
+    }
+    // Masking of the view direction, and masking-shadowing of the pair
+    float smithView(Vector o) const { return 1 / (1 + lambda(o)); }
+    float smith(Vector o, Vector i) const { return 1 / (1 + lambda(o) + lambda(i)); }
+    Vector fresnel(float cosine) const {
+        float m = 1 - cosine;
+        float m5 = m * m * m * m * m;
+        return reflectance + (Vector(1) - reflectance) * m5;
+    }
+};
+
+#endif // _BSDF_H
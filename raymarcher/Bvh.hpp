@@ -0,0 +1,208 @@
+#ifndef _BVH_H
+#define _BVH_H
+
+#include <math.h>
+#include <vector>
+#include <algorithm>
+#include "Vector.hpp"
+#include "Dual.hpp"
+
+#define PRIMITIVE_SPHERE 0 // center, radius in size.x
+#define PRIMITIVE_BOX 1    // center, half extents in size
+#define PRIMITIVE_PLANE 2  // horizontal floor at center.y, has no bounds
+
+struct Bounds {
+    Vector min = Vector(1e30);
+    Vector max = Vector(-1e30);
+
+    void grow(Vector p) {
+        min = Vector(fminf(min.x, p.x), fminf(min.y, p.y), fminf(min.z, p.z));
+        max = Vector(fmaxf(max.x, p.x), fmaxf(max.y, p.y), fmaxf(max.z, p.z));
+    }
+    void grow(const Bounds &b) {
+        grow(b.min);
+        grow(b.max);
+    }
+    Vector center() const {
+        return (min + max) * 0.5;
+    }
+
+    // Distance from p to the box, 0 inside. Never more than the distance
+    // to anything the box contains, so it bounds their SDFs from below.
+    float distance(Vector p) const {
+        float dx = fmaxf(fmaxf(min.x - p.x, p.x - max.x), 0);
+        float dy = fmaxf(fmaxf(min.y - p.y, p.y - max.y), 0);
+        float dz = fmaxf(fmaxf(min.z - p.z, p.z - max.z), 0);
+        return sqrtf(dx * dx + dy * dy + dz * dz);
+    }
+};
+
+struct Primitive {
+    int type;
+    Vector center;
+    Vector size;
+    int material;
+
+    bool bounded() const {
+        return type != PRIMITIVE_PLANE;
+    }
+
+    Bounds bounds() const {
+        Vector extent = type == PRIMITIVE_SPHERE ? Vector(size.x) : size;
+        Bounds b;
+        b.grow(center - extent);
+        b.grow(center + extent);
+        return b;
+    }
+
+    // Templated so it also runs on a DualVector for the gradient
+    template<class P>
+    auto distance(P p) const -> decltype(p.x) {
+        decltype(p.x) dx = p.x - center.x, dy = p.y - center.y, dz = p.z - center.z;
+        if (type == PRIMITIVE_SPHERE) return sqrtv(dx * dx + dy * dy + dz * dz) - size.x;
+        if (type == PRIMITIVE_PLANE) return dy;
+        // Box
+        decltype(p.x) qx = absv(dx) - size.x, qy = absv(dy) - size.y, qz = absv(dz) - size.z;
+        decltype(p.x) ox = maxv(qx, 0), oy = maxv(qy, 0), oz = maxv(qz, 0);
+        return sqrtv(ox * ox + oy * oy + oz * oz) + minv(maxv(qx, maxv(qy, qz)), 0);
+    }
+};
+
+// Signed distance scene whose bounded primitives sit in a bounding
+// volume hierarchy. A query walks the tree nearest child first and only
+// evaluates primitives in nodes whose box is closer than the best
+// distance found so far. Unbounded primitives are always evaluated.
+class BvhScene {
+public:
+    void add(Primitive primitive) {
+        if (primitive.bounded()) primitives.push_back(primitive);
+        else unbounded.push_back(primitive);
+    }
+
+    int primitiveCount() const {
+        return primitives.size() + unbounded.size();
+    }
+
+    void build() {
+        nodes.clear();
+        if (primitives.empty()) return;
+        nodes.push_back(Node());
+        buildNode(0, 0, primitives.size());
+    }
+
+    float distance(Vector p, int &material) const {
+        const Primitive *prim;
+        float d = nearest(p, prim);
+        material = prim ? prim->material : 0;
+        return d;
+    }
+
+    // Gradient of the nearest primitive, which is the gradient of the
+    // whole scene wherever one primitive is strictly nearest
+    Vector gradient(Vector p) const {
+        const Primitive *prim;
+        nearest(p, prim);
+        if (!prim) return Vector(0);
+        Dual<float> d = prim->distance(DualVector<float>::variable(p));
+        return Vector(d.dx, d.dy, d.dz);
+    }
+
+private:
+    float nearest(Vector p, const Primitive *&prim) const {
+        float best = 1e9;
+        prim = nullptr;
+        for (const Primitive &candidate : unbounded) {
+            float d = candidate.distance(p);
+            if (d < best) {
+                best = d;
+                prim = &candidate;
+            }
+        }
+        if (nodes.empty()) return best;
+
+        // Nodes waiting to be visited, with the distance to their box
+        struct Entry {
+            int node;
+            float bound;
+        } stack[64];
+        int top = 0;
+        stack[top++] = { 0, nodes[0].bounds.distance(p) };
+        while (top > 0) {
+            Entry entry = stack[--top];
+            if (entry.bound >= best) continue;
+            const Node &node = nodes[entry.node];
+
+            if (node.count > 0) {
+                for (int i = node.first; i < node.first + node.count; i++) {
+                    float d = primitives[i].distance(p);
+                    if (d < best) {
+                        best = d;
+                        prim = &primitives[i];
+                    }
+                }
+                continue;
+            }
+
+            // Push the farther child first so the nearer one is visited
+            // next and tightens best as early as possible
+            Entry near = { node.first, nodes[node.first].bounds.distance(p) };
+            Entry far = { node.first + 1, nodes[node.first + 1].bounds.distance(p) };
+            if (far.bound < near.bound) std::swap(near, far);
+            if (far.bound < best) stack[top++] = far;
+            if (near.bound < best) stack[top++] = near;
+        }
+        return best;
+    }
+
+    // Leaves hold primitives [first, first + count). Interior nodes have
+    // count 0 and their two children stored at first and first + 1.
+    struct Node {
+        Bounds bounds;
+        int first;
+        int count;
+    };
+
+    static const int leafSize = 4;
+
+    std::vector<Primitive> primitives;
+    std::vector<Primitive> unbounded;
+    std::vector<Node> nodes;
+
+    // Fills nodes[index] for primitives [begin, end), splitting at the
+    // median along the widest axis of the primitive centers
+    void buildNode(int index, int begin, int end) {
+        Bounds bounds, centers;
+        for (int i = begin; i < end; i++) {
+            bounds.grow(primitives[i].bounds());
+            centers.grow(primitives[i].bounds().center());
+        }
+        nodes[index].bounds = bounds;
+
+        if (end - begin <= leafSize) {
+            nodes[index].first = begin;
+            nodes[index].count = end - begin;
+            return;
+        }
+
+        Vector extent = centers.max - centers.min;
+        int axis = extent.x > extent.y && extent.x > extent.z ? 0 : extent.y > extent.z ? 1 : 2;
+        int mid = (begin + end) / 2;
+        std::nth_element(primitives.begin() + begin, primitives.begin() + mid, primitives.begin() + end,
+            [axis](const Primitive &a, const Primitive &b) {
+                Vector ca = a.bounds().center(), cb = b.bounds().center();
+                return axis == 0 ? ca.x < cb.x : axis == 1 ? ca.y < cb.y : ca.z < cb.z;
+            });
+
+        // Both children are allocated before either is built so that
+        // siblings stay adjacent
+        int children = nodes.size();
+        nodes.push_back(Node());
+        nodes.push_back(Node());
+        nodes[index].first = children;
+        nodes[index].count = 0;
+        buildNode(children, begin, mid);
+        buildNode(children + 1, mid, end);
+    }
+};
+
+#endif // _BVH_H
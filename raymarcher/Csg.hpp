@@ -0,0 +1,267 @@
+#ifndef _CSG_H
+#define _CSG_H
+
+#include <math.h>
+#include "Vector.hpp"
+#include "VectorN.hpp"
+#include "RayPacket.hpp"
+#include "Dual.hpp"
+
+// Signed distance scenes written as types, for example
+//
+//   typedef Union<
+//       Material<1, Translate<0, 1000, 0, Sphere<1000>>>,
+//       Material<2, Plane<0>>
+//   > Scene;
+//
+// Every node is a struct of static functions, so the whole tree is known
+// at compile time and inlines down to the same code as a hand-written
+// min-chain. Lengths are given in thousandths (CSG_UNIT) because C++14
+// can't take floats as template arguments; angles are in degrees.
+//
+// Each node has two entry points, both templated on the point type so
+// they work for a Vector or a PointPacket (taken by value, since
+// Vector's methods aren't const):
+//   distance(p)           distance only, materials compile away
+//   distance(p, material) also reports the material of the nearest surface
+// Materials are floats (packet lanes) and default to 1 when no Material
+// node is above a primitive.
+
+#define CSG_UNIT 0.001f
+
+// Float type of one coordinate of a point: float or FloatN
+template<class P>
+using CsgFloat = decltype(P::x);
+
+// Primitives
+
+template<int Radius>
+struct Sphere {
+    template<class P> static CsgFloat<P> distance(P p) {
+        return p.magnitude() - Radius * CSG_UNIT;
+    }
+    template<class P> static CsgFloat<P> distance(P p, CsgFloat<P> &material) {
+        material = 1;
+        return distance(p);
+    }
+};
+
+// Half extents
+template<int X, int Y, int Z>
+struct Box {
+    template<class P> static CsgFloat<P> distance(P p) {
+        CsgFloat<P> qx = absv(p.x) - X * CSG_UNIT;
+        CsgFloat<P> qy = absv(p.y) - Y * CSG_UNIT;
+        CsgFloat<P> qz = absv(p.z) - Z * CSG_UNIT;
+        P outside(maxv(qx, 0), maxv(qy, 0), maxv(qz, 0));
+        return outside.magnitude() + minv(maxv(qx, maxv(qy, qz)), 0);
+    }
+    template<class P> static CsgFloat<P> distance(P p, CsgFloat<P> &material) {
+        material = 1;
+        return distance(p);
+    }
+};
+
+// Horizontal plane, solid below Height
+template<int Height>
+struct Plane {
+    template<class P> static CsgFloat<P> distance(P p) {
+        return p.y - Height * CSG_UNIT;
+    }
+    template<class P> static CsgFloat<P> distance(P p, CsgFloat<P> &material) {
+        material = 1;
+        return distance(p);
+    }
+};
+
+// Operators
+
+template<class... Children>
+struct Union;
+
+template<class A>
+struct Union<A> {
+    template<class P> static CsgFloat<P> distance(P p) {
+        return A::distance(p);
+    }
+    template<class P> static CsgFloat<P> distance(P p, CsgFloat<P> &material) {
+        return A::distance(p, material);
+    }
+};
+
+template<class A, class... Rest>
+struct Union<A, Rest...> {
+    template<class P> static CsgFloat<P> distance(P p) {
+        return minv(A::distance(p), Union<Rest...>::distance(p));
+    }
+    template<class P> static CsgFloat<P> distance(P p, CsgFloat<P> &material) {
+        CsgFloat<P> restMaterial;
+        CsgFloat<P> a = A::distance(p, material);
+        CsgFloat<P> b = Union<Rest...>::distance(p, restMaterial);
+        material = blend(b < a, restMaterial, material);
+        return minv(a, b);
+    }
+};
+
+template<class... Children>
+struct Intersect;
+
+template<class A>
+struct Intersect<A> {
+    template<class P> static CsgFloat<P> distance(P p) {
+        return A::distance(p);
+    }
+    template<class P> static CsgFloat<P> distance(P p, CsgFloat<P> &material) {
+        return A::distance(p, material);
+    }
+};
+
+template<class A, class... Rest>
+struct Intersect<A, Rest...> {
+    template<class P> static CsgFloat<P> distance(P p) {
+        return maxv(A::distance(p), Intersect<Rest...>::distance(p));
+    }
+    template<class P> static CsgFloat<P> distance(P p, CsgFloat<P> &material) {
+        CsgFloat<P> restMaterial;
+        CsgFloat<P> a = A::distance(p, material);
+        CsgFloat<P> b = Intersect<Rest...>::distance(p, restMaterial);
+        material = blend(b > a, restMaterial, material);
+        return maxv(a, b);
+    }
+};
+
+// A with B cut out of it, keeping the material of A
+template<class A, class B>
+struct Subtract {
+    template<class P> static CsgFloat<P> distance(P p) {
+        return maxv(A::distance(p), CsgFloat<P>(0) - B::distance(p));
+    }
+    template<class P> static CsgFloat<P> distance(P p, CsgFloat<P> &material) {
+        CsgFloat<P> a = A::distance(p, material);
+        return maxv(a, CsgFloat<P>(0) - B::distance(p));
+    }
+};
+
+// Polynomial smooth minimum with blend radius K
+template<int K, class A, class B>
+struct SmoothUnion {
+    template<class P> static CsgFloat<P> smooth(CsgFloat<P> a, CsgFloat<P> b) {
+        const float k = K * CSG_UNIT;
+        CsgFloat<P> h = minv(maxv((b - a) * (0.5f / k) + 0.5f, 0), 1);
+        return b + (a - b) * h - h * (CsgFloat<P>(1) - h) * k;
+    }
+    template<class P> static CsgFloat<P> distance(P p) {
+        return smooth<P>(A::distance(p), B::distance(p));
+    }
+    template<class P> static CsgFloat<P> distance(P p, CsgFloat<P> &material) {
+        CsgFloat<P> bMaterial;
+        CsgFloat<P> a = A::distance(p, material);
+        CsgFloat<P> b = B::distance(p, bMaterial);
+        material = blend(b < a, bMaterial, material);
+        return smooth<P>(a, b);
+    }
+};
+
+// Gives every surface of Child material Id, overriding any set inside it
+template<int Id, class Child>
+struct Material {
+    template<class P> static CsgFloat<P> distance(P p) {
+        return Child::distance(p);
+    }
+    template<class P> static CsgFloat<P> distance(P p, CsgFloat<P> &material) {
+        material = Id;
+        return Child::distance(p);
+    }
+};
+
+// Transforms
+
+template<int X, int Y, int Z, class Child>
+struct Translate {
+    template<class P> static P transform(P p) {
+        return P(p.x - X * CSG_UNIT, p.y - Y * CSG_UNIT, p.z - Z * CSG_UNIT);
+    }
+    template<class P> static CsgFloat<P> distance(P p) {
+        return Child::distance(transform(p));
+    }
+    template<class P> static CsgFloat<P> distance(P p, CsgFloat<P> &material) {
+        return Child::distance(transform(p), material);
+    }
+};
+
+// Rotation about the y axis
+template<int Degrees, class Child>
+struct RotateY {
+    template<class P> static P transform(P p) {
+        // Points are rotated the opposite way to the shape
+        const float c = cosf(-Degrees * 0.0174532925f);
+        const float s = sinf(-Degrees * 0.0174532925f);
+        return P(p.x * c - p.z * s, p.y, p.x * s + p.z * c);
+    }
+    template<class P> static CsgFloat<P> distance(P p) {
+        return Child::distance(transform(p));
+    }
+    template<class P> static CsgFloat<P> distance(P p, CsgFloat<P> &material) {
+        return Child::distance(transform(p), material);
+    }
+};
+
+template<int Factor, class Child>
+struct Scale {
+    template<class P> static CsgFloat<P> distance(P p) {
+        return Child::distance(p * (1 / (Factor * CSG_UNIT))) * (Factor * CSG_UNIT);
+    }
+    template<class P> static CsgFloat<P> distance(P p, CsgFloat<P> &material) {
+        return Child::distance(p * (1 / (Factor * CSG_UNIT)), material) * (Factor * CSG_UNIT);
+    }
+};
+
+// Infinite copies of Child, centered on multiples of the period along
+// each axis. A period of 0 leaves that axis alone.
+template<int X, int Y, int Z, class Child>
+struct Repeat {
+    template<class F> static F wrap(F a, float period) {
+        return a - floorv(a * (1 / period) + 0.5f) * period;
+    }
+    template<class P> static P transform(P p) {
+        if (X > 0) p.x = wrap(p.x, X * CSG_UNIT);
+        if (Y > 0) p.y = wrap(p.y, Y * CSG_UNIT);
+        if (Z > 0) p.z = wrap(p.z, Z * CSG_UNIT);
+        return p;
+    }
+    template<class P> static CsgFloat<P> distance(P p) {
+        return Child::distance(transform(p));
+    }
+    template<class P> static CsgFloat<P> distance(P p, CsgFloat<P> &material) {
+        return Child::distance(transform(p), material);
+    }
+};
+
+// Adapters to the renderer's estimator signatures, e.g.
+// RayMarch(ray, &CsgDistance<Scene>)
+template<class Scene>
+float CsgDistance(Vector p, int &material) {
+    float m;
+    float d = Scene::distance(p, m);
+    material = (int)m;
+    return d;
+}
+
+template<class Scene>
+void CsgDistancePacket(const PointPacket &p, PacketFloat &distance, PacketFloat &material) {
+    distance = Scene::distance(p, material);
+}
+
+template<class Scene>
+void CsgGradient(Vector p, Vector &gradient) {
+    Dual<float> d = Scene::distance(DualVector<float>::variable(p));
+    gradient = Vector(d.dx, d.dy, d.dz);
+}
+
+template<class Scene>
+void CsgGradientPacket(const PointPacket &p, PointPacket &gradient) {
+    Dual<PacketFloat> d = Scene::distance(DualVector<PacketFloat>::variable(p));
+    gradient = PointPacket(d.dx, d.dy, d.dz);
+}
+
+#endif // _CSG_H
@@ -0,0 +1,198 @@
+#ifndef _DENOISER_H
+#define _DENOISER_H
+
+#include <math.h>
+#include <stdlib.h>
+#include <thread>
+#include <vector>
+#include "Vector.hpp"
+
+// Edge-aware à-trous wavelet filter in the style of SVGF (Schied et al.
+// 2017). Color is divided by the first hit's albedo so that textures
+// aren't blurred, and the resulting irradiance is smoothed with a 5x5
+// kernel whose taps spread out twice as far every iteration. Each tap is
+// weighted down where the normal or depth differs from the center pixel,
+// or where its luminance differs by more than the noise explains. The
+// noise starts as a local estimate of the luminance variance and is
+// filtered along with the color.
+class Denoiser {
+public:
+    int iterations = 5;
+    // Higher lets more luminance difference through
+    float colorSigma = 4;
+    // Exponent on the cosine between normals
+    float normalPower = 128;
+    // Depth difference allowed, in units of the local depth gradient
+    float depthSigma = 1;
+
+    // Filters color into out, which may be the same buffer. Pixels whose
+    // ray missed have a zero normal.
+    void run(const Vector *color, const Vector *albedo, const Vector *normal, const float *depth,
+        int width, int height, Vector *out, int threads) {
+        this->albedo = albedo;
+        this->normal = normal;
+        this->depth = depth;
+        this->width = width;
+        this->height = height;
+        int count = width * height;
+        for (int b = 0; b < 2; b++) {
+            irradiance[b].resize(count);
+            variance[b].resize(count);
+        }
+        gradient.resize(count);
+
+        parallel(threads, height, [&](int y) {
+            for (int x = 0; x < width; x++) {
+                int i = y * width + x;
+                irradiance[0][i] = color[i] / Demodulation(albedo[i]);
+                gradient[i] = depthGradient(x, y);
+            }
+        });
+        parallel(threads, height, [&](int y) {
+            for (int x = 0; x < width; x++) variance[0][y * width + x] = initialVariance(x, y);
+        });
+
+        int from = 0;
+        for (int i = 0; i < iterations; i++) {
+            parallel(threads, height, [&](int y) {
+                for (int x = 0; x < width; x++) filter(x, y, 1 << i, from);
+            });
+            from ^= 1;
+        }
+
+        parallel(threads, height, [&](int y) {
+            for (int x = 0; x < width; x++) {
+                int i = y * width + x;
+                out[i] = irradiance[from][i] * Demodulation(albedo[i]);
+            }
+        });
+    }
+
+private:
+    const Vector *albedo;
+    const Vector *normal;
+    const float *depth;
+    int width, height;
+
+    std::vector<Vector> irradiance[2];
+    std::vector<float> variance[2];
+    std::vector<Vector> gradient; // Depth gradient per pixel in x and y
+
+    static float Luminance(Vector c) {
+        return 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z;
+    }
+
+    // Albedo the color is divided by, kept away from 0 so black surfaces
+    // don't blow up
+    static Vector Demodulation(Vector a) {
+        return Vector(fmaxf(a.x, 0.01f), fmaxf(a.y, 0.01f), fmaxf(a.z, 0.01f));
+    }
+
+    // Smaller of the one-sided differences, so a depth edge next to the
+    // pixel doesn't make it look steep
+    Vector depthGradient(int x, int y) const {
+        float z = depth[y * width + x];
+        float dx = 1e9f, dy = 1e9f;
+        if (x > 0) dx = fminf(dx, fabsf(z - depth[y * width + x - 1]));
+        if (x < width - 1) dx = fminf(dx, fabsf(depth[y * width + x + 1] - z));
+        if (y > 0) dy = fminf(dy, fabsf(z - depth[(y - 1) * width + x]));
+        if (y < height - 1) dy = fminf(dy, fabsf(depth[(y + 1) * width + x] - z));
+        return Vector(dx < 1e9f ? dx : 0, dy < 1e9f ? dy : 0, 0);
+    }
+
+    // How much a tap at q, offset (dx, dy) from p, is allowed to count
+    // for p judging by the geometry alone
+    float geometryWeight(int p, int q, int dx, int dy) const {
+        Vector np = normal[p], nq = normal[q];
+        float w = 1;
+        float npSq = np % np, nqSq = nq % nq;
+        if (npSq > 0 || nqSq > 0) {
+            float cosine = np % nq;
+            if (cosine <= 0) return 0;
+            w = powf(cosine, normalPower);
+        }
+        Vector g = gradient[p];
+        float expected = depthSigma * (g.x * abs(dx) + g.y * abs(dy)) + 1e-3f;
+        return w * expf(-fabsf(depth[p] - depth[q]) / expected);
+    }
+
+    // Variance of the luminance over the 5x5 pixels around p that share
+    // its surface
+    float initialVariance(int x, int y) const {
+        int p = y * width + x;
+        float sum = 0, sumSq = 0, weights = 0;
+        for (int dy = -2; dy <= 2; dy++) {
+            for (int dx = -2; dx <= 2; dx++) {
+                int qx = x + dx, qy = y + dy;
+                if (qx < 0 || qy < 0 || qx >= width || qy >= height) continue;
+                int q = qy * width + qx;
+                float w = geometryWeight(p, q, dx, dy);
+                float l = Luminance(irradiance[0][q]);
+                sum += w * l;
+                sumSq += w * l * l;
+                weights += w;
+            }
+        }
+        float mean = sum / weights;
+        return fmaxf(0, sumSq / weights - mean * mean);
+    }
+
+    // 3x3 Gaussian blur of the variance, which is too noisy by itself to
+    // stop edges with
+    float blurredVariance(int x, int y, int from) const {
+        float sum = 0, weights = 0;
+        for (int dy = -1; dy <= 1; dy++) {
+            for (int dx = -1; dx <= 1; dx++) {
+                int qx = x + dx, qy = y + dy;
+                if (qx < 0 || qy < 0 || qx >= width || qy >= height) continue;
+                float w = (dx == 0 ? 0.5f : 0.25f) * (dy == 0 ? 0.5f : 0.25f);
+                sum += w * variance[from][qy * width + qx];
+                weights += w;
+            }
+        }
+        return sum / weights;
+    }
+
+    // One à-trous step with taps step pixels apart, reading buffer from
+    // and writing the other
+    void filter(int x, int y, int step, int from) {
+        static const float kernel[3] = { 3 / 8.f, 1 / 4.f, 1 / 16.f };
+        int p = y * width + x;
+        float luminance = Luminance(irradiance[from][p]);
+        float spread = colorSigma * sqrtf(blurredVariance(x, y, from)) + 1e-4f;
+
+        Vector sum(0);
+        float varianceSum = 0, weights = 0;
+        for (int ky = -2; ky <= 2; ky++) {
+            for (int kx = -2; kx <= 2; kx++) {
+                int qx = x + kx * step, qy = y + ky * step;
+                if (qx < 0 || qy < 0 || qx >= width || qy >= height) continue;
+                int q = qy * width + qx;
+                float w = kernel[abs(kx)] * kernel[abs(ky)];
+                if (q != p) {
+                    w *= geometryWeight(p, q, kx * step, ky * step);
+                    w *= expf(-fabsf(luminance - Luminance(irradiance[from][q])) / spread);
+                }
+                sum = sum + irradiance[from][q] * w;
+                varianceSum += w * w * variance[from][q];
+                weights += w;
+            }
+        }
+        irradiance[from ^ 1][p] = sum / weights;
+        variance[from ^ 1][p] = varianceSum / (weights * weights);
+    }
+
+    template<class F>
+    static void parallel(int threads, int count, F work) {
+        if (threads < 1) threads = 1;
+        std::vector<std::thread> workers;
+        for (int t = 0; t < threads; t++) {
+            workers.emplace_back([&, t]() {
+                for (int i = t; i < count; i += threads) work(i);
+            });
+        }
+        for (auto &w : workers) w.join();
+    }
+};
+
+#endif // _DENOISER_H
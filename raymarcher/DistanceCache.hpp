@@ -0,0 +1,257 @@
+#ifndef _DISTANCECACHE_H
+#define _DISTANCECACHE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <thread>
+#include <vector>
+#include "Vector.hpp"
+
+// Steps shorter than this are left to the exact distance function
+#define DISTANCE_CACHE_MIN_STEP 0.1
+
+// Distance function baked into a sparse two level grid, for taking the
+// long steps of a march through empty space without evaluating the
+// scene. The region is split into cubic bricks. A coarse grid of
+// samples at the brick corners covers bricks far from any surface; bricks
+// closer than that get their own finer grid of samples; bricks that may
+// contain a surface store nothing and are evaluated exactly.
+//
+// bound() interpolates the samples trilinearly and subtracts the most a
+// distance function with slope at most 1 can differ from that, so the
+// result never exceeds the true distance and is always a safe step.
+class DistanceCache {
+public:
+    typedef float(Estimator)(Vector, int&);
+
+    // Identifies the scene the cache was baked from, so a saved cache is
+    // only loaded back for the same scene
+    uint64_t key = 0;
+
+    // Samples the estimator over the box [min, max] with bricks of the
+    // given size, each split resolution times per axis where needed
+    void bake(Estimator *estimator, Vector min, Vector max, float brickSize, int resolution, int threads) {
+        origin = min;
+        this->brickSize = brickSize;
+        this->resolution = resolution;
+        nx = (int)ceilf((max.x - min.x) / brickSize);
+        ny = (int)ceilf((max.y - min.y) / brickSize);
+        nz = (int)ceilf((max.z - min.z) / brickSize);
+
+        coarse.assign((nx + 1) * (ny + 1) * (nz + 1), 0);
+        parallel(threads, nz + 1, [&](int z) {
+            int unused;
+            for (int y = 0; y <= ny; y++) {
+                for (int x = 0; x <= nx; x++) {
+                    coarse[coarseIndex(x, y, z)] = estimator(origin + Vector(x, y, z) * brickSize, unused);
+                }
+            }
+        });
+
+        // A brick can only hold a surface if a corner is within half its
+        // diagonal of one. Past one more brick size the coarse grid alone
+        // gives steps of at least a brick.
+        const float halfDiagonal = 0.8660254f * brickSize;
+        bricks.assign(nx * ny * nz, EXACT);
+        int fineCount = 0;
+        for (int z = 0; z < nz; z++) {
+            for (int y = 0; y < ny; y++) {
+                for (int x = 0; x < nx; x++) {
+                    float nearest = 1e30;
+                    for (int c = 0; c < 8; c++) {
+                        nearest = fminf(nearest, coarse[coarseIndex(x + (c & 1), y + (c >> 1 & 1), z + (c >> 2))]);
+                    }
+                    int32_t &brick = bricks[brickIndex(x, y, z)];
+                    if (nearest >= halfDiagonal + brickSize) brick = COARSE;
+                    else if (nearest > halfDiagonal) brick = fineCount++;
+                }
+            }
+        }
+
+        int side = resolution + 1;
+        fine.assign((size_t)fineCount * side * side * side, 0);
+        parallel(threads, nz, [&](int z) {
+            int unused;
+            float spacing = brickSize / resolution;
+            for (int y = 0; y < ny; y++) {
+                for (int x = 0; x < nx; x++) {
+                    int32_t brick = bricks[brickIndex(x, y, z)];
+                    if (brick < 0) continue;
+                    Vector corner = origin + Vector(x, y, z) * brickSize;
+                    float *samples = &fine[(size_t)brick * side * side * side];
+                    for (int k = 0; k < side; k++) {
+                        for (int j = 0; j < side; j++) {
+                            for (int i = 0; i < side; i++) {
+                                samples[(k * side + j) * side + i] = estimator(corner + Vector(i, j, k) * spacing, unused);
+                            }
+                        }
+                    }
+                }
+            }
+        });
+    }
+
+    // Lower bound on the distance at p, or 0 where the scene has to be
+    // evaluated exactly
+    float bound(Vector p) const {
+        Vector local = (p - origin) / brickSize;
+        if (!(local.x >= 0 && local.y >= 0 && local.z >= 0 && local.x < nx && local.y < ny && local.z < nz)) return 0;
+        int x = (int)local.x, y = (int)local.y, z = (int)local.z;
+        int32_t brick = bricks[brickIndex(x, y, z)];
+        if (brick == EXACT) return 0;
+
+        float tx = local.x - x, ty = local.y - y, tz = local.z - z;
+        if (brick == COARSE) {
+            return interpolate(&coarse[coarseIndex(x, y, z)], 1, nx + 1, (nx + 1) * (ny + 1), tx, ty, tz)
+                - slack(tx, ty, tz) * brickSize;
+        }
+
+        int side = resolution + 1;
+        const float *samples = &fine[(size_t)brick * side * side * side];
+        tx *= resolution;
+        ty *= resolution;
+        tz *= resolution;
+        int i = (int)tx, j = (int)ty, k = (int)tz;
+        if (i == resolution) i--;
+        if (j == resolution) j--;
+        if (k == resolution) k--;
+        tx -= i;
+        ty -= j;
+        tz -= k;
+        return interpolate(&samples[(k * side + j) * side + i], 1, side, side * side, tx, ty, tz)
+            - slack(tx, ty, tz) * (brickSize / resolution);
+    }
+
+    int brickCount() const { return bricks.size(); }
+    int fineBrickCount() const { return fine.size() / ((resolution + 1) * (resolution + 1) * (resolution + 1)); }
+    int exactBrickCount() const {
+        int count = 0;
+        for (int32_t b : bricks) count += b == EXACT;
+        return count;
+    }
+    size_t bytes() const {
+        return (coarse.size() + fine.size()) * sizeof(float) + bricks.size() * sizeof(int32_t);
+    }
+
+    bool save(const char *path) const {
+        FILE *fp = fopen(path, "wb");
+        if (!fp) return false;
+        Header h = header();
+        bool ok = fwrite(&h, sizeof(h), 1, fp) == 1
+            && fwrite(coarse.data(), sizeof(float), coarse.size(), fp) == coarse.size()
+            && fwrite(bricks.data(), sizeof(int32_t), bricks.size(), fp) == bricks.size()
+            && fwrite(fine.data(), sizeof(float), fine.size(), fp) == fine.size();
+        fclose(fp);
+        return ok;
+    }
+
+    // Loads a cache saved for the same key, region and brick layout
+    bool load(const char *path, uint64_t key, Vector min, Vector max, float brickSize, int resolution) {
+        FILE *fp = fopen(path, "rb");
+        if (!fp) return false;
+        DistanceCache c;
+        c.key = key;
+        c.origin = min;
+        c.brickSize = brickSize;
+        c.resolution = resolution;
+        c.nx = (int)ceilf((max.x - min.x) / brickSize);
+        c.ny = (int)ceilf((max.y - min.y) / brickSize);
+        c.nz = (int)ceilf((max.z - min.z) / brickSize);
+        Header expected = c.header();
+
+        Header h;
+        bool ok = fread(&h, sizeof(h), 1, fp) == 1;
+        // Only the fine brick count may differ, everything else has to match
+        expected.fineCount = h.fineCount;
+        ok = ok && memcmp(&h, &expected, sizeof(h)) == 0;
+        if (ok) {
+            int side = resolution + 1;
+            c.coarse.resize((c.nx + 1) * (c.ny + 1) * (c.nz + 1));
+            c.bricks.resize(c.nx * c.ny * c.nz);
+            c.fine.resize((size_t)h.fineCount * side * side * side);
+            ok = fread(c.coarse.data(), sizeof(float), c.coarse.size(), fp) == c.coarse.size()
+                && fread(c.bricks.data(), sizeof(int32_t), c.bricks.size(), fp) == c.bricks.size()
+                && fread(c.fine.data(), sizeof(float), c.fine.size(), fp) == c.fine.size();
+        }
+        fclose(fp);
+        if (ok) *this = c;
+        return ok;
+    }
+
+private:
+    enum { COARSE = -1, EXACT = -2 };
+
+    Vector origin;
+    float brickSize = 1;
+    int resolution = 1;
+    int nx = 0, ny = 0, nz = 0;
+
+    std::vector<float> coarse;   // (nx + 1) * (ny + 1) * (nz + 1) brick corners
+    std::vector<int32_t> bricks; // COARSE, EXACT or the index of the brick's fine samples
+    std::vector<float> fine;     // (resolution + 1)^3 samples per fine brick
+
+    struct Header {
+        char magic[4];
+        uint32_t version;
+        uint64_t key;
+        float origin[3];
+        float brickSize;
+        int32_t resolution, nx, ny, nz;
+        int32_t fineCount;
+    };
+
+    Header header() const {
+        Header h;
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, "SDFC", 4);
+        h.version = 1;
+        h.key = key;
+        h.origin[0] = origin.x;
+        h.origin[1] = origin.y;
+        h.origin[2] = origin.z;
+        h.brickSize = brickSize;
+        h.resolution = resolution;
+        h.nx = nx;
+        h.ny = ny;
+        h.nz = nz;
+        h.fineCount = fineBrickCount();
+        return h;
+    }
+
+    int coarseIndex(int x, int y, int z) const { return (z * (ny + 1) + y) * (nx + 1) + x; }
+    int brickIndex(int x, int y, int z) const { return (z * ny + y) * nx + x; }
+
+    static float interpolate(const float *s, int sx, int sy, int sz, float tx, float ty, float tz) {
+        float x00 = s[0] + (s[sx] - s[0]) * tx;
+        float x10 = s[sy] + (s[sy + sx] - s[sy]) * tx;
+        float x01 = s[sz] + (s[sz + sx] - s[sz]) * tx;
+        float x11 = s[sz + sy] + (s[sz + sy + sx] - s[sz + sy]) * tx;
+        float y0 = x00 + (x10 - x00) * ty;
+        float y1 = x01 + (x11 - x01) * ty;
+        return y0 + (y1 - y0) * tz;
+    }
+
+    // How far the trilinear blend of the corner distances can be above the
+    // true distance, in cell sizes. Each corner value is within its distance
+    // to p of the true one, and the weighted mean of those distances is at
+    // most the root of the weighted mean of their squares.
+    static float slack(float tx, float ty, float tz) {
+        return sqrtf(tx * (1 - tx) + ty * (1 - ty) + tz * (1 - tz));
+    }
+
+    template<class F>
+    static void parallel(int threads, int count, F work) {
+        if (threads < 1) threads = 1;
+        std::vector<std::thread> workers;
+        for (int t = 0; t < threads; t++) {
+            workers.emplace_back([&, t]() {
+                for (int i = t; i < count; i += threads) work(i);
+            });
+        }
+        for (auto &w : workers) w.join();
+    }
+};
+
+#endif // _DISTANCECACHE_H
@@ -0,0 +1,106 @@
+#ifndef _DUAL_H
+#define _DUAL_H
+
+#include <math.h>
+#include "Vector.hpp"
+#include "VectorN.hpp"
+
+// Forward-mode automatic differentiation. A Dual carries a value along
+// with its partial derivatives with respect to x, y and z, and every
+// operation applies the chain rule. Running a distance function on a
+// DualVector made with variable() gives the distance and its gradient,
+// which is the surface normal, in a single pass.
+//
+// F is float or FloatN, so gradients of whole packets work the same way.
+template<class F>
+struct Dual {
+    F v;
+    F dx, dy, dz;
+
+    Dual() : v(0), dx(0), dy(0), dz(0) {}
+    // Constants have no derivative
+    template<class T>
+    Dual(T a) : v(a), dx(0), dy(0), dz(0) {}
+    Dual(F v, F dx, F dy, F dz) : v(v), dx(dx), dy(dy), dz(dz) {}
+
+    friend Dual operator+(Dual a, Dual b) {
+        return Dual(a.v + b.v, a.dx + b.dx, a.dy + b.dy, a.dz + b.dz);
+    }
+    friend Dual operator-(Dual a, Dual b) {
+        return Dual(a.v - b.v, a.dx - b.dx, a.dy - b.dy, a.dz - b.dz);
+    }
+    friend Dual operator*(Dual a, Dual b) {
+        return Dual(a.v * b.v,
+            a.dx * b.v + a.v * b.dx,
+            a.dy * b.v + a.v * b.dy,
+            a.dz * b.v + a.v * b.dz);
+    }
+    friend Dual operator/(Dual a, Dual b) {
+        F inv = F(1) / b.v;
+        F q = a.v * inv;
+        return Dual(q, (a.dx - q * b.dx) * inv, (a.dy - q * b.dy) * inv, (a.dz - q * b.dz) * inv);
+    }
+    Dual operator-() const {
+        return Dual(F(0) - v, F(0) - dx, F(0) - dy, F(0) - dz);
+    }
+
+    // Comparisons look at the value only and give a bool or MaskN
+    friend auto operator<(Dual a, Dual b) -> decltype(a.v < b.v) { return a.v < b.v; }
+    friend auto operator>(Dual a, Dual b) -> decltype(a.v > b.v) { return a.v > b.v; }
+
+    friend Dual blend(decltype(F() < F()) m, Dual a, Dual b) {
+        return Dual(blend(m, a.v, b.v), blend(m, a.dx, b.dx), blend(m, a.dy, b.dy), blend(m, a.dz, b.dz));
+    }
+    friend Dual sqrtv(Dual a) {
+        // The derivative is infinite at 0, where it would turn the zero
+        // derivatives of e.g. a box's outside part into NaN. Taking it as
+        // 0 there gives the gradient of the rest of the expression.
+        F s = sqrtv(a.v);
+        F k = blend(s > F(0), F(0.5f) / s, F(0));
+        return Dual(s, a.dx * k, a.dy * k, a.dz * k);
+    }
+    friend Dual absv(Dual a) {
+        return blend(a.v < F(0), -a, a);
+    }
+    friend Dual floorv(Dual a) {
+        return Dual(floorv(a.v));
+    }
+    friend Dual minv(Dual a, Dual b) {
+        return blend(b.v < a.v, b, a);
+    }
+    friend Dual maxv(Dual a, Dual b) {
+        return blend(b.v > a.v, b, a);
+    }
+};
+
+// Point whose coordinates are Duals, with the operations the distance
+// functions in Csg.hpp and SdfProgram.hpp need
+template<class F>
+struct DualVector {
+    Dual<F> x, y, z;
+
+    DualVector() {}
+    DualVector(Dual<F> x, Dual<F> y, Dual<F> z) : x(x), y(y), z(z) {}
+
+    // Point that the derivatives are taken with respect to
+    template<class P>
+    static DualVector variable(P p) {
+        return DualVector(
+            Dual<F>(p.x, F(1), F(0), F(0)),
+            Dual<F>(p.y, F(0), F(1), F(0)),
+            Dual<F>(p.z, F(0), F(0), F(1)));
+    }
+
+    friend DualVector operator-(DualVector a, DualVector b) {
+        return DualVector(a.x - b.x, a.y - b.y, a.z - b.z);
+    }
+    friend DualVector operator*(DualVector a, Dual<F> b) {
+        return DualVector(a.x * b, a.y * b, a.z * b);
+    }
+
+    Dual<F> magnitude() const {
+        return sqrtv(x * x + y * y + z * z);
+    }
+};
+
+#endif // _DUAL_H
@@ -0,0 +1,161 @@
+#ifndef _FRAMEBUFFER_H
+#define _FRAMEBUFFER_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <thread>
+#include <vector>
+#include "Vector.hpp"
+#include "VectorN.hpp"
+
+typedef FloatN<VECTOR_LANES> ToneMapFloat;
+
+#define FRAMEBUFFER_MAGIC 0x46554246 // "FBUF"
+#define FRAMEBUFFER_VERSION 2
+
+// Float accumulation buffer. Every pixel keeps the sum of its paths'
+// radiance and how many there were, so passes can keep adding to it and
+// the radiance stays HDR until an image is written. Tone mapping to 8
+// bits is a separate pass over the whole buffer.
+class Framebuffer {
+public:
+    int width, height;
+    std::vector<float> sums; // RGB, rows top to bottom
+    std::vector<int> counts;
+
+    Framebuffer(int width, int height) : width(width), height(height) {
+        clear();
+    }
+
+    void clear() {
+        sums.assign((size_t)width * height * 3, 0);
+        counts.assign((size_t)width * height, 0);
+    }
+
+    // Adds samples paths whose mean radiance is radiance
+    void add(int i, Vector radiance, int samples=1) {
+        if (samples != 1) radiance = radiance * samples;
+        sums[i * 3] += radiance.x;
+        sums[i * 3 + 1] += radiance.y;
+        sums[i * 3 + 2] += radiance.z;
+        counts[i] += samples;
+    }
+
+    // Adds the paths of another buffer the same size, like another shard
+    // of the same render
+    void add(const Framebuffer &other) {
+        for (size_t i = 0; i < sums.size(); i++) sums[i] += other.sums[i];
+        for (size_t i = 0; i < counts.size(); i++) counts[i] += other.counts[i];
+    }
+
+    // Replaces the pixel's mean, keeping its count
+    void setMean(int i, Vector radiance) {
+        int samples = counts[i];
+        counts[i] = 0;
+        sums[i * 3] = sums[i * 3 + 1] = sums[i * 3 + 2] = 0;
+        add(i, radiance, samples);
+    }
+
+    Vector mean(int i) const {
+        if (counts[i] == 0) return Vector(0);
+        return Vector(sums[i * 3], sums[i * 3 + 1], sums[i * 3 + 2]) / counts[i];
+    }
+
+    // Mean radiance of every pixel as float RGB
+    void resolve(float *rgb) const {
+        for (int i = 0; i < width * height; i++) {
+            Vector m = mean(i);
+            rgb[i * 3] = m.x;
+            rgb[i * 3 + 1] = m.y;
+            rgb[i * 3 + 2] = m.z;
+        }
+    }
+
+    float averageSamples() const {
+        long long samples = 0;
+        for (int c : counts) samples += c;
+        return (float)samples / (width * height);
+    }
+
+    // Saves the sums and counts, for merging with other shards. The key
+    // stands for the scene and settings, since renders that differ in
+    // them can't be merged. The shard is shardIndex of shardCount, split
+    // by samples or by tiles, so a merge can tell whether it has all of
+    // them.
+    bool save(const char *filename, uint64_t key, int shardIndex=0, int shardCount=1, bool sampleShards=false) const {
+        FILE *fp = fopen(filename, "wb");
+        if (!fp) return false;
+        uint32_t header[7] = { FRAMEBUFFER_MAGIC, FRAMEBUFFER_VERSION, (uint32_t)width, (uint32_t)height,
+            (uint32_t)shardIndex, (uint32_t)shardCount, sampleShards };
+        bool ok = fwrite(header, sizeof(header), 1, fp) == 1 && fwrite(&key, sizeof(key), 1, fp) == 1 &&
+            fwrite(sums.data(), sizeof(float), sums.size(), fp) == sums.size() &&
+            fwrite(counts.data(), sizeof(int), counts.size(), fp) == counts.size();
+        return fclose(fp) == 0 && ok;
+    }
+
+    bool load(const char *filename, uint64_t &key, int &shardIndex, int &shardCount, bool &sampleShards) {
+        FILE *fp = fopen(filename, "rb");
+        if (!fp) return false;
+        uint32_t header[7];
+        bool ok = fread(header, sizeof(header), 1, fp) == 1 && header[0] == FRAMEBUFFER_MAGIC &&
+            header[1] == FRAMEBUFFER_VERSION && header[4] < header[5] &&
+            fread(&key, sizeof(key), 1, fp) == 1;
+        if (ok) {
+            width = header[2];
+            height = header[3];
+            shardIndex = header[4];
+            shardCount = header[5];
+            sampleShards = header[6] != 0;
+            clear();
+            ok = fread(sums.data(), sizeof(float), sums.size(), fp) == sums.size() &&
+                fread(counts.data(), sizeof(int), counts.size(), fp) == counts.size();
+        }
+        fclose(fp);
+        return ok;
+    }
+
+    // Tone maps the means with L / (1 + L) into 8-bit RGB. Channels are
+    // all mapped the same way, so every row is run through as one flat
+    // array of floats, VECTOR_LANES at a time.
+    void toneMap(unsigned char *rgb, int threads) const {
+        if (threads < 1) threads = 1;
+        std::vector<std::thread> workers;
+        for (int t = 0; t < threads; t++) {
+            workers.emplace_back([&, t]() {
+                for (int y = t; y < height; y += threads) toneMapRow(y, rgb);
+            });
+        }
+        for (auto &w : workers) w.join();
+    }
+
+private:
+    template<class F>
+    static F ToneMap(F mean) {
+        // Lifts black slightly off 0
+        F l = mean + (float)(5. / 241.);
+        l = l / (1.f + l) * 255.f;
+        return l;
+    }
+
+    void toneMapRow(int y, unsigned char *rgb) const {
+        int begin = y * width * 3, end = begin + width * 3;
+        int i = begin;
+        for (; i + VECTOR_LANES <= end; i += VECTOR_LANES) {
+            float n[VECTOR_LANES], out[VECTOR_LANES];
+            for (int lane = 0; lane < VECTOR_LANES; lane++) {
+                int c = counts[(i + lane) / 3];
+                n[lane] = c > 0 ? c : 1;
+            }
+            ToneMapFloat mean = ToneMapFloat::load(&sums[i]) / ToneMapFloat::load(n);
+            minv(ToneMap(mean), ToneMapFloat(255)).store(out);
+            for (int lane = 0; lane < VECTOR_LANES; lane++) rgb[i + lane] = (int)out[lane];
+        }
+        for (; i < end; i++) {
+            int c = counts[i / 3];
+            float v = ToneMap(sums[i] / (c > 0 ? c : 1));
+            rgb[i] = v > 255 ? 255 : (int)v;
+        }
+    }
+};
+
+#endif // _FRAMEBUFFER_H
@@ -0,0 +1,100 @@
+#ifndef _HEATMAP_H
+#define _HEATMAP_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <math.h>
+#include <vector>
+#include <algorithm>
+#include "Ray.hpp"
+#include "../Image.hpp"
+
+// Work spent on one pixel, from the thread's MarchStats before and after
+// it was rendered. Marches shared by several pixels, like ray packets,
+// are split evenly between them.
+struct PixelCost {
+    float rays = 0;
+    float steps = 0;
+    float evaluations = 0;
+
+    // Adds share of what the marches on this thread did since before
+    void addSince(const MarchStats &before, float share=1) {
+        rays += (marchStats.rays - before.rays) * share;
+        steps += (marchStats.steps - before.steps) * share;
+        evaluations += (marchStats.evaluations - before.evaluations) * share;
+    }
+
+    void add(const PixelCost &c) {
+        rays += c.rays;
+        steps += c.steps;
+        evaluations += c.evaluations;
+    }
+};
+
+// Work and wall time spent on one tile, including its cone marches
+struct TileCost {
+    int x = 0, y = 0; // Top-left pixel
+    double seconds = 0;
+    uint64_t rays = 0;
+    uint64_t steps = 0;
+    uint64_t evaluations = 0;
+
+    void addSince(const MarchStats &before, double elapsed) {
+        seconds += elapsed;
+        rays += marchStats.rays - before.rays;
+        steps += marchStats.steps - before.steps;
+        evaluations += marchStats.evaluations - before.evaluations;
+    }
+};
+
+// Black through purple, red and yellow to white as t goes from 0 to 1
+void HeatColor(float t, unsigned char *rgb) {
+    static const float ramp[5][3] = {
+        { 0, 0, 0 }, { 0.35f, 0.05f, 0.55f }, { 0.9f, 0.2f, 0.15f }, { 1, 0.85f, 0.1f }, { 1, 1, 1 }
+    };
+    t = fminf(fmaxf(t, 0), 1) * 4;
+    int i = t >= 4 ? 3 : (int)t;
+    float f = t - i;
+    for (int c = 0; c < 3; c++) {
+        rgb[c] = (unsigned char)(255 * (ramp[i][c] + (ramp[i + 1][c] - ramp[i][c]) * f));
+    }
+}
+
+// Writes one value per pixel as a heatmap. The top of the ramp is the
+// 99th percentile, so a few extreme pixels don't flatten the rest.
+// Returns the value it was scaled to.
+float WriteHeatmap(const char *filename, const float *values, int width, int height) {
+    int count = width * height;
+    std::vector<float> sorted(values, values + count);
+    std::nth_element(sorted.begin(), sorted.begin() + count * 99 / 100, sorted.end());
+    float scale = sorted[count * 99 / 100];
+    if (scale <= 0) scale = 1;
+
+    std::vector<unsigned char> rgb(count * 3);
+    for (int i = 0; i < count; i++) HeatColor(values[i] / scale, &rgb[i * 3]);
+    if (!WriteImage(filename, rgb.data(), width, height)) printf("Failed to write %s.\n", filename);
+    return scale;
+}
+
+// Prints the tiles that took the longest
+void PrintWorstTiles(const TileCost *tiles, int tileCount, int count) {
+    std::vector<const TileCost*> order;
+    double total = 0;
+    for (int i = 0; i < tileCount; i++) {
+        order.push_back(&tiles[i]);
+        total += tiles[i].seconds;
+    }
+    count = std::min(count, tileCount);
+    std::partial_sort(order.begin(), order.begin() + count, order.end(), [](const TileCost *a, const TileCost *b) {
+        return a->seconds > b->seconds;
+    });
+    printf("Slowest tiles (average %f ms):\n", 1000 * total / tileCount);
+    printf("  %6s %6s %10s %10s %12s %12s\n", "x", "y", "ms", "rays", "steps/ray", "evals/ray");
+    for (int i = 0; i < count; i++) {
+        const TileCost &t = *order[i];
+        printf("  %6d %6d %10.3f %10llu %12.2f %12.2f\n", t.x, t.y, 1000 * t.seconds, (unsigned long long)t.rays,
+            t.rays ? (double)t.steps / t.rays : 0., t.rays ? (double)t.evaluations / t.rays : 0.);
+    }
+}
+
+#endif // _HEATMAP_H
@@ -0,0 +1,38 @@
+#ifndef _PIXELSTATS_H
+#define _PIXELSTATS_H
+
+#include <math.h>
+#include "Vector.hpp"
+
+// Running mean of a pixel's path samples, plus the variance of their
+// luminance (Welford's algorithm) so the renderer can tell how noisy
+// the pixel still is.
+struct PixelStats {
+    Vector mean;
+    float luminanceMean = 0;
+    float luminanceM2 = 0;
+    int count = 0;
+
+    static float Luminance(Vector c) {
+        return 0.2126 * c.x + 0.7152 * c.y + 0.0722 * c.z;
+    }
+
+    void add(Vector sample) {
+        count++;
+        mean = mean + (sample - mean) / count;
+
+        float l = Luminance(sample);
+        float delta = l - luminanceMean;
+        luminanceMean += delta / count;
+        luminanceM2 += delta * (l - luminanceMean);
+    }
+
+    // Standard error of the mean luminance
+    float standardError() const {
+        if (count < 2) return 1e9;
+        float variance = luminanceM2 / (count - 1);
+        return sqrtf(variance / count);
+    }
+};
+
+#endif // _PIXELSTATS_H
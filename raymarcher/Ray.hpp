@@ -2,7 +2,10 @@
 #define _RAY_H
 
 #include "Vector.hpp"
+#include "DistanceCache.hpp"
 #include <stdio.h>
+#include <stdint.h>
+#include <math.h>
 
 struct Ray {
     Vector origin;
@@ -22,36 +25,229 @@ struct RayHit {
 
 typedef float(DistanceEstimator)(Vector, int&);
 
-RayHit RayMarch(Ray ray, DistanceEstimator* estimator, float maxDistance=100, float maxHits=99) {
-    float d = 0;
+// Fills in the gradient of the distance at a point, which on a surface
+// points along its normal. Marches given one use it for hit normals in
+// place of three extra distance evaluations.
+typedef void(GradientEstimator)(Vector, Vector&);
+
+// Over-relaxation factor for enhanced sphere tracing (Keinert et al.
+// 2014). Each step goes this many times the distance estimate; when the
+// sphere at the new point no longer overlaps the previous one the step
+// may have passed a surface, so the march goes back, takes the plain
+// step and stops relaxing. 1 is plain sphere tracing.
+#define MARCH_RELAXATION 1.6
+
+// Where a march stands, so that it can be picked up again
+struct MarchState {
+    float traveled = 0;
     float closest = 1e9;
-    float totalD = 0;
     int steps = 0;
+    float relaxation = MARCH_RELAXATION;
+    float lastDistance = 0; // Estimate at the point the last step started from
+    float lastStep = 0;
+    float closestRatio = 1e9; // Smallest distance over distance traveled, for soft shadows
+};
+
+// Counters for the marches run on this thread. The renderer sums them
+// over its threads once they are done.
+struct MarchStats {
+    uint64_t rays = 0;
+    uint64_t steps = 0;
+    uint64_t capped = 0; // Rays that used up their step budget
+    uint64_t cones = 0;
+    uint64_t coneSteps = 0;
+    // Distance and gradient evaluations, a packet evaluation counting
+    // once per lane. Differs from steps by cache lookups, retaken steps
+    // and normals.
+    uint64_t evaluations = 0;
+};
+thread_local MarchStats marchStats;
+
+// Gradient at p by forward differences, for estimators without an exact
+// gradient. d is the distance at p, which the caller already has.
+Vector ForwardDifference(DistanceEstimator *estimator, Vector p, float d) {
+    int unused;
+    marchStats.evaluations += 3;
+    return Vector(
+        estimator(p + Vector(0.01, 0, 0), unused) - d,
+        estimator(p + Vector(0, 0.01, 0), unused) - d,
+        estimator(p + Vector(0, 0, 0.01), unused) - d
+    );
+}
+
+// ForwardDifference as a GradientEstimator, for marches that take one as
+// a template argument. The caller counts the evaluation at p.
+template<DistanceEstimator *estimator>
+void FiniteDifferenceGradient(Vector p, Vector &gradient) {
+    int unused;
+    gradient = ForwardDifference(estimator, p, estimator(p, unused));
+}
+
+// Continues a march from the given state. Used by the packet marcher to
+// finish rays that diverged from the rest of their packet. Without a
+// gradient estimator, normals fall back to finite differences. With a
+// cache, steps through empty space come from its bounds and the estimator
+// is only run close to surfaces.
+RayHit ContinueRayMarch(Ray ray, DistanceEstimator* estimator, GradientEstimator *gradient, const DistanceCache *cache, MarchState s, float maxDistance=100, float maxHits=99) {
+    float d = 0;
     int hitType;
 
-    for (; totalD < maxDistance; totalD += d) {
-        Vector hitPos = ray.origin + ray.direction * totalD;
+    while (s.traveled < maxDistance) {
+        Vector hitPos = ray.origin + ray.direction * s.traveled;
+
+        if (cache) {
+            float bound = cache->bound(hitPos);
+            if (bound > DISTANCE_CACHE_MIN_STEP) {
+                // The bound is already safe, so there is nothing to relax
+                // or check against
+                if (bound < s.closest) s.closest = bound;
+                s.lastDistance = 0;
+                s.lastStep = 0;
+                s.traveled += bound;
+                if (++s.steps > maxHits) {
+                    marchStats.capped++;
+                    break;
+                }
+                continue;
+            }
+        }
+
         d = estimator(hitPos, hitType);
-        if (d < closest) closest = d;
-        if (d < 0.01) {
-            Vector hitNorm = !Vector(
-                estimator(hitPos + Vector(0.01, 0, 0), steps) - d,
-                estimator(hitPos + Vector(0, 0.01, 0), steps) - d,
-                estimator(hitPos + Vector(0, 0, 0.01), steps) - d
-            );
-            return {
-                ray, hitPos, hitNorm,
-                d, totalD, closest, steps,
-                hitType
-            };
+        marchStats.evaluations++;
+
+        if (s.relaxation > 1 && fabsf(d) + s.lastDistance < s.lastStep) {
+            // Spheres don't overlap, retake the last step unrelaxed
+            s.traveled += s.lastDistance - s.lastStep;
+            s.lastStep = s.lastDistance;
+            s.relaxation = 1;
+        } else {
+            if (d < s.closest) s.closest = d;
+            if (d < 0.01) {
+                Vector hitNorm;
+                if (gradient) {
+                    gradient(hitPos, hitNorm);
+                    marchStats.evaluations++;
+                } else {
+                    hitNorm = ForwardDifference(estimator, hitPos, d);
+                }
+                hitNorm = !hitNorm;
+                marchStats.steps += s.steps;
+                return {
+                    ray, hitPos, hitNorm,
+                    d, s.traveled, s.closest, s.steps,
+                    hitType
+                };
+            }
+            s.lastDistance = d;
+            s.lastStep = d * s.relaxation;
+            s.traveled += s.lastStep;
+        }
+
+        if (++s.steps > maxHits) {
+            marchStats.capped++;
+            break;
         }
-        if (++steps > maxHits) break;
     }
+    marchStats.steps += s.steps;
     return {
-        ray, ray.origin + ray.direction * totalD, Vector(0),
-        0, totalD, closest, steps,
+        ray, ray.origin + ray.direction * s.traveled, Vector(0),
+        0, s.traveled, s.closest, s.steps,
         0
     };
 }
 
-#endif
\ No newline at end of file
+// Rays known to be clear of surfaces for their first start units, e.g.
+// from ConeMarch, can skip marching them
+RayHit RayMarch(Ray ray, DistanceEstimator* estimator, GradientEstimator *gradient, const DistanceCache *cache, float maxDistance=100, float maxHits=99, float start=0) {
+    marchStats.rays++;
+    MarchState state;
+    state.traveled = start;
+    return ContinueRayMarch(ray, estimator, gradient, cache, state, maxDistance, maxHits);
+}
+
+RayHit RayMarch(Ray ray, DistanceEstimator* estimator, GradientEstimator *gradient, float maxDistance=100, float maxHits=99) {
+    return RayMarch(ray, estimator, gradient, nullptr, maxDistance, maxHits);
+}
+
+RayHit RayMarch(Ray ray, DistanceEstimator* estimator, float maxDistance=100, float maxHits=99) {
+    return RayMarch(ray, estimator, nullptr, maxDistance, maxHits);
+}
+
+// Continues a visibility march from the given state. See MarchVisibility.
+float ContinueMarchVisibility(Ray ray, DistanceEstimator* estimator, const DistanceCache *cache, MarchState s, float maxDistance, float softness=0, float maxHits=99) {
+    int hitType;
+    float visibility = 1;
+
+    while (s.traveled < maxDistance) {
+        Vector p = ray.origin + ray.direction * s.traveled;
+
+        float bound = cache ? cache->bound(p) : 0;
+        if (bound > DISTANCE_CACHE_MIN_STEP) {
+            // Bounds are below the true distance, so the penumbra comes
+            // out no lighter than it should
+            s.closestRatio = fminf(s.closestRatio, bound / s.traveled);
+            s.lastDistance = 0;
+            s.lastStep = 0;
+            s.traveled += bound;
+        } else {
+            float d = estimator(p, hitType);
+            marchStats.evaluations++;
+            if (s.relaxation > 1 && fabsf(d) + s.lastDistance < s.lastStep) {
+                s.traveled += s.lastDistance - s.lastStep;
+                s.lastStep = s.lastDistance;
+                s.relaxation = 1;
+            } else if (d < 0.01) {
+                visibility = 0;
+                break;
+            } else {
+                s.closestRatio = fminf(s.closestRatio, d / s.traveled);
+                s.lastDistance = d;
+                s.lastStep = d * s.relaxation;
+                s.traveled += s.lastStep;
+            }
+        }
+
+        if (++s.steps > maxHits) {
+            marchStats.capped++;
+            break;
+        }
+    }
+    marchStats.steps += s.steps;
+    if (visibility > 0 && softness > 0) visibility = fminf(1, softness * s.closestRatio);
+    return visibility;
+}
+
+// Shadow ray query: whether anything lies along the ray before
+// maxDistance. Stops at the first surface and skips the normal and
+// material that RayMarch works out. Returns 1 when the way is clear and
+// 0 when it is blocked. With a softness above 0, clear rays that passed
+// close to a surface return softness times the smallest distance over
+// distance traveled instead, clamped to 1, which darkens them into a
+// penumbra. Smaller softness gives wider penumbras.
+float MarchVisibility(Ray ray, DistanceEstimator* estimator, float maxDistance, float softness=0, const DistanceCache *cache=nullptr, float maxHits=99) {
+    marchStats.rays++;
+    return ContinueMarchVisibility(ray, estimator, cache, MarchState(), maxDistance, softness, maxHits);
+}
+
+// Marches a cone with its apex at origin, around the unit vector axis,
+// whose radius grows by tanHalfAngle per unit along it. Returns how far
+// along the axis the cone is known to be clear of surfaces, so that every
+// ray from origin inside the cone can start its march that far out.
+float ConeMarch(Vector origin, Vector axis, float tanHalfAngle, DistanceEstimator* estimator, float maxDistance=100, float maxSteps=99) {
+    float traveled = 0;
+    int hitType;
+    marchStats.cones++;
+    for (int steps = 0; steps < maxSteps && traveled < maxDistance; steps++) {
+        // How far the sphere at this point reaches past the cone's cross
+        // section. Stepping by less than this over 1 + tanHalfAngle keeps
+        // the next cross section inside it too.
+        float clearance = estimator(origin + axis * traveled, hitType) - traveled * tanHalfAngle;
+        marchStats.evaluations++;
+        if (clearance < 0.01) break;
+        traveled += clearance / (1 + tanHalfAngle);
+        marchStats.coneSteps++;
+    }
+    return traveled < maxDistance ? traveled : maxDistance;
+}
+
+#endif
@@ -0,0 +1,244 @@
+#ifndef _RAYPACKET_H
+#define _RAYPACKET_H
+
+#include "Vector.hpp"
+#include "VectorN.hpp"
+#include "Ray.hpp"
+
+// Number of rays marched together, one per float lane of the widest
+// vector unit we are compiling for (compile with -mavx2 to get 8).
+#define PACKET_WIDTH VECTOR_LANES
+
+// Once this few lanes are still marching the packet is abandoned and
+// the remaining rays finish on the scalar path.
+#define PACKET_MIN_ACTIVE (PACKET_WIDTH / 4)
+
+typedef FloatN<PACKET_WIDTH> PacketFloat;
+typedef MaskN<PACKET_WIDTH> PacketMask;
+typedef VectorN<PACKET_WIDTH> PointPacket;
+
+struct RayPacket {
+    PointPacket origin;
+    PointPacket direction;
+
+    void set(int lane, Ray ray) {
+        origin.set(lane, ray.origin);
+        direction.set(lane, ray.direction);
+    }
+
+    Ray get(int lane) const {
+        return { origin[lane], direction[lane] };
+    }
+
+    // Point at distance t along every ray
+    PointPacket at(PacketFloat t) const {
+        return origin + direction * t;
+    }
+};
+
+// Packet form of DistanceEstimator: fills distance and hitType for
+// every lane of the packet. Hit types are carried in float lanes so
+// they can be selected with the same blends as the distances.
+typedef void(PacketDistanceEstimator)(const PointPacket&, PacketFloat&, PacketFloat&);
+
+// Packet form of GradientEstimator
+typedef void(PacketGradientEstimator)(const PointPacket&, PointPacket&);
+
+// Packet estimators that run a scalar one lane by lane, for scenes that
+// have no vectorized distance function
+template<DistanceEstimator *estimator>
+void LanewiseDistance(const PointPacket &p, PacketFloat &distance, PacketFloat &hitType) {
+    float d[PACKET_WIDTH], type[PACKET_WIDTH];
+    for (int i = 0; i < PACKET_WIDTH; i++) {
+        int t;
+        d[i] = estimator(p[i], t);
+        type[i] = t;
+    }
+    distance = PacketFloat::load(d);
+    hitType = PacketFloat::load(type);
+}
+
+template<GradientEstimator *gradient>
+void LanewiseGradient(const PointPacket &p, PointPacket &g) {
+    for (int i = 0; i < PACKET_WIDTH; i++) {
+        Vector lane;
+        gradient(p[i], lane);
+        g.set(i, lane);
+    }
+}
+
+// Mask of a packet's first lanes, for packets padded out to
+// PACKET_WIDTH with copies of their last ray
+PacketMask FirstLanes(int lanes) {
+    float index[PACKET_WIDTH];
+    for (int i = 0; i < PACKET_WIDTH; i++) index[i] = i;
+    return PacketFloat::load(index) < PacketFloat((float)lanes);
+}
+
+// Packet form of FiniteDifferenceGradient, the default packet gradient
+// of RayMarchPacket. The caller counts the evaluation at p.
+template<PacketDistanceEstimator *packetEstimator>
+void FiniteDifferenceGradientPacket(const PointPacket &p, PointPacket &gradient) {
+    PacketFloat d, nx, ny, nz, unused;
+    packetEstimator(p, d, unused);
+    packetEstimator(p + PointPacket(Vector(0.01, 0, 0)), nx, unused);
+    packetEstimator(p + PointPacket(Vector(0, 0.01, 0)), ny, unused);
+    packetEstimator(p + PointPacket(Vector(0, 0, 0.01)), nz, unused);
+    gradient = PointPacket(nx, ny, nz) - d;
+    marchStats.evaluations += 3 * PACKET_WIDTH;
+}
+
+// Marches all rays of the packet in lock-step, writing one RayHit per
+// lane that is identical in layout to what RayMarch returns. Both
+// estimators are template arguments so the packet estimator is inlined
+// into the loop; the scalar one is only used for divergent lanes. The
+// gradient estimators default to finite differences, and each lane can
+// start some way along its ray and have its own maximum distance. Only
+// the first lanes rays are marched and counted, and only their hits are
+// written.
+template<DistanceEstimator *estimator, PacketDistanceEstimator *packetEstimator,
+    GradientEstimator *gradient=FiniteDifferenceGradient<estimator>,
+    PacketGradientEstimator *packetGradient=FiniteDifferenceGradientPacket<packetEstimator>>
+void RayMarchPacket(const RayPacket &packet, RayHit *hits, PacketFloat maxDistance=100, float maxHits=99, PacketFloat start=0, int lanes=PACKET_WIDTH) {
+    PacketFloat totalD = start;
+    PacketFloat closest = 1e9;
+    PacketFloat steps = 0;
+    PacketFloat relaxation = MARCH_RELAXATION;
+    PacketFloat lastDistance = 0;
+    PacketFloat lastStep = 0;
+    PacketFloat d, hitType;
+    PacketMask active = (start < maxDistance) & FirstLanes(lanes);
+    PacketMask hit = false;
+    marchStats.rays += active.count();
+
+    // Same steps as ContinueRayMarch, lane by lane. Finished lanes keep
+    // being evaluated with the rest of the packet. A lane that hit never
+    // moves again, so d and hitType still hold its hit values when the
+    // loop ends.
+    while (active.count() > PACKET_MIN_ACTIVE) {
+        packetEstimator(packet.at(totalD), d, hitType);
+        marchStats.evaluations += PACKET_WIDTH;
+
+        PacketMask failed = active & (relaxation > 1) & (absv(d) + lastDistance < lastStep);
+        PacketMask stepping = active & ~failed;
+        closest = blend(stepping, minv(closest, d), closest);
+        PacketMask newHit = stepping & (d < 0.01f);
+        hit = hit | newHit;
+        active = active & ~newHit;
+        stepping = stepping & ~newHit;
+
+        totalD = blend(failed, totalD + (lastDistance - lastStep), totalD);
+        lastStep = blend(failed, lastDistance, lastStep);
+        relaxation = blend(failed, 1, relaxation);
+
+        lastDistance = blend(stepping, d, lastDistance);
+        lastStep = blend(stepping, d * relaxation, lastStep);
+        totalD = blend(stepping, totalD + lastStep, totalD);
+
+        steps = blend(active, steps + 1, steps);
+        PacketMask capped = active & (steps > maxHits);
+        marchStats.capped += capped.count();
+        active = active & ~capped & (totalD < maxDistance);
+    }
+
+    // Normals for every lane that hit, from one packet gradient
+    PointPacket hitPos = packet.at(totalD);
+    PointPacket hitNorm;
+    packetGradient(hitPos, hitNorm);
+    hitNorm = !hitNorm;
+    marchStats.evaluations += PACKET_WIDTH;
+
+    for (int i = 0; i < lanes; i++) {
+        Ray ray = packet.get(i);
+        if (active[i]) {
+            // Divergent stragglers finish where they left off on the scalar path
+            MarchState state;
+            state.traveled = totalD[i];
+            state.closest = closest[i];
+            state.steps = (int)steps[i];
+            state.relaxation = relaxation[i];
+            state.lastDistance = lastDistance[i];
+            state.lastStep = lastStep[i];
+            hits[i] = ContinueRayMarch(ray, estimator, gradient, nullptr, state, maxDistance[i], maxHits);
+            continue;
+        }
+        marchStats.steps += (int)steps[i];
+        if (hit[i]) {
+            hits[i] = {
+                ray, hitPos[i], hitNorm[i],
+                d[i], totalD[i], closest[i], (int)steps[i],
+                (int)hitType[i]
+            };
+        } else {
+            hits[i] = {
+                ray, hitPos[i], Vector(0),
+                0, totalD[i], closest[i], (int)steps[i],
+                0
+            };
+        }
+    }
+}
+
+// Packet form of MarchVisibility, returning each lane's visibility.
+// Lanes stop as soon as they are blocked. Only the first lanes rays are
+// marched and counted.
+template<DistanceEstimator *estimator, PacketDistanceEstimator *packetEstimator>
+PacketFloat MarchVisibilityPacket(const RayPacket &packet, PacketFloat maxDistance, float softness=0, float maxHits=99, int lanes=PACKET_WIDTH) {
+    PacketFloat totalD = 0;
+    PacketFloat closestRatio = 1e9;
+    PacketFloat steps = 0;
+    PacketFloat relaxation = MARCH_RELAXATION;
+    PacketFloat lastDistance = 0;
+    PacketFloat lastStep = 0;
+    PacketFloat d, hitType;
+    PacketMask active = (totalD < maxDistance) & FirstLanes(lanes);
+    PacketMask blocked = false;
+    marchStats.rays += active.count();
+
+    while (active.count() > PACKET_MIN_ACTIVE) {
+        packetEstimator(packet.at(totalD), d, hitType);
+        marchStats.evaluations += PACKET_WIDTH;
+
+        PacketMask failed = active & (relaxation > 1) & (absv(d) + lastDistance < lastStep);
+        PacketMask stepping = active & ~failed;
+        PacketMask newBlocked = stepping & (d < 0.01f);
+        blocked = blocked | newBlocked;
+        active = active & ~newBlocked;
+        stepping = stepping & ~newBlocked;
+
+        totalD = blend(failed, totalD + (lastDistance - lastStep), totalD);
+        lastStep = blend(failed, lastDistance, lastStep);
+        relaxation = blend(failed, 1, relaxation);
+
+        closestRatio = blend(stepping, minv(closestRatio, d / totalD), closestRatio);
+        lastDistance = blend(stepping, d, lastDistance);
+        lastStep = blend(stepping, d * relaxation, lastStep);
+        totalD = blend(stepping, totalD + lastStep, totalD);
+
+        steps = blend(active, steps + 1, steps);
+        PacketMask capped = active & (steps > maxHits);
+        marchStats.capped += capped.count();
+        active = active & ~capped & (totalD < maxDistance);
+    }
+
+    float visibility[PACKET_WIDTH];
+    for (int i = 0; i < PACKET_WIDTH; i++) {
+        if (active[i]) {
+            MarchState state;
+            state.traveled = totalD[i];
+            state.steps = (int)steps[i];
+            state.relaxation = relaxation[i];
+            state.lastDistance = lastDistance[i];
+            state.lastStep = lastStep[i];
+            state.closestRatio = closestRatio[i];
+            visibility[i] = ContinueMarchVisibility(packet.get(i), estimator, nullptr, state, maxDistance[i], softness, maxHits);
+            continue;
+        }
+        marchStats.steps += (int)steps[i];
+        if (blocked[i]) visibility[i] = 0;
+        else visibility[i] = softness > 0 ? fminf(1, softness * closestRatio[i]) : 1;
+    }
+    return PacketFloat::load(visibility);
+}
+
+#endif
@@ -0,0 +1,126 @@
+#ifndef _SAMPLER_H
+#define _SAMPLER_H
+
+#include <stdint.h>
+
+// Where a Sampler's numbers come from
+enum SampleSequence {
+    // Independent random numbers
+    SEQUENCE_RANDOM,
+    // Owen-scrambled Sobol points. Consecutive pairs of dimensions of a
+    // bounce form a 2D Sobol sequence over the pixel's samples, so the
+    // samples of a pixel cover the square evenly instead of clumping,
+    // with each pair and pixel scrambled differently.
+    SEQUENCE_SOBOL
+};
+
+// Stateless random numbers for path sampling. Every value is a pure
+// function of (pixel, seed) as the key and (sample, bounce, dimension)
+// as the counter, pushed through the Philox4x32-10 block cipher. No
+// state is shared between threads and the image comes out the same no
+// matter how many threads render it or in which order tiles are taken.
+//
+// The sample is the index of the path among those of its pixel, so the
+// low discrepancy of SEQUENCE_SOBOL holds over a pixel's paths.
+// Dimensions should be taken in pairs for 2D decisions like a bounce
+// direction.
+class Sampler {
+public:
+    Sampler(uint32_t pixel, uint32_t seed=0, SampleSequence sequence=SEQUENCE_RANDOM)
+        : pixel(pixel), seed(seed), sample(0), depth(0), dimension(0), sequence(sequence)
+    {}
+
+    // Sampler for the index-th of count paths branching off this one.
+    // Calling it with count 1 keeps the current path.
+    Sampler split(int index, int count) const {
+        Sampler s = *this;
+        s.sample = sample * count + index;
+        s.dimension = 0;
+        return s;
+    }
+
+    // Restarts the dimensions for a new bounce of the path
+    void startBounce(int bounce) {
+        depth = bounce;
+        dimension = 0;
+    }
+
+    // Uniform float in [0, 1)
+    float next() {
+        if (sequence == SEQUENCE_SOBOL) return sobol();
+        uint32_t counter[4] = { sample, depth, dimension++, 0 };
+        uint32_t key[2] = { pixel, seed };
+        philox(counter, key);
+        return (counter[0] >> 8) * (1.f / 16777216.f);
+    }
+
+private:
+    uint32_t pixel;
+    uint32_t seed;
+    uint32_t sample;
+    uint32_t depth;
+    uint32_t dimension;
+    SampleSequence sequence;
+
+    // Hashed Owen scrambling (Burley 2020). The pair's Philox output
+    // seeds a shuffle of the sample order and a scramble of each of its
+    // two dimensions.
+    float sobol() {
+        uint32_t component = dimension & 1;
+        uint32_t counter[4] = { 0x50B01u, depth, dimension++ >> 1, 0 };
+        uint32_t key[2] = { pixel, seed };
+        philox(counter, key);
+
+        uint32_t index = scramble(sample, counter[0]);
+        uint32_t x = 0;
+        if (component == 0) {
+            x = reverseBits(index);
+        } else {
+            // Second Sobol dimension, direction numbers from x + 1
+            for (uint32_t v = 0x80000000u; index; index >>= 1, v ^= v >> 1) {
+                if (index & 1) x ^= v;
+            }
+        }
+        x = scramble(x, counter[1 + component]);
+        return (x >> 8) * (1.f / 16777216.f);
+    }
+
+    // Random permutation of the bits of x in which each bit only
+    // depends on itself and the bits above it
+    static uint32_t scramble(uint32_t x, uint32_t seed) {
+        x = reverseBits(x);
+        // Laine-Karras style hash, with Burley's constants
+        x += seed;
+        x ^= x * 0x6C50B47Cu;
+        x ^= x * 0xB82F1E52u;
+        x ^= x * 0xC7AFE638u;
+        x ^= x * 0x8D22F6E6u;
+        return reverseBits(x);
+    }
+
+    static uint32_t reverseBits(uint32_t x) {
+        x = (x << 16) | (x >> 16);
+        x = ((x & 0x00FF00FFu) << 8) | ((x & 0xFF00FF00u) >> 8);
+        x = ((x & 0x0F0F0F0Fu) << 4) | ((x & 0xF0F0F0F0u) >> 4);
+        x = ((x & 0x33333333u) << 2) | ((x & 0xCCCCCCCCu) >> 2);
+        x = ((x & 0x55555555u) << 1) | ((x & 0xAAAAAAAAu) >> 1);
+        return x;
+    }
+
+    static void philox(uint32_t counter[4], uint32_t key[2]) {
+        for (int round = 0; round < 10; round++) {
+            uint64_t p0 = (uint64_t)0xD2511F53 * counter[0];
+            uint64_t p1 = (uint64_t)0xCD9E8D57 * counter[2];
+            uint32_t c0 = (uint32_t)(p1 >> 32) ^ counter[1] ^ key[0];
+            uint32_t c2 = (uint32_t)(p0 >> 32) ^ counter[3] ^ key[1];
+            counter[0] = c0;
+            counter[1] = (uint32_t)p1;
+            counter[2] = c2;
+            counter[3] = (uint32_t)p0;
+            key[0] += 0x9E3779B9;
+            key[1] += 0xBB67AE85;
+        }
+    }
+};
+
+#endif // _SAMPLER_H
@@ -0,0 +1,127 @@
+#ifndef _SCENE_H
+#define _SCENE_H
+
+#include "Vector.hpp"
+#include "RayPacket.hpp"
+#include "Bvh.hpp"
+#include "SceneFile.hpp"
+#include "Csg.hpp"
+
+// The built-in scenes and the estimators the renderer marches them
+// with, shared with benchmark.cpp so it times the same code. Define
+// SCENE and BVH_FIELD_SIZE before including this to pick a scene.
+//
+// SCENE_FIELD is the hand-written infinite sphere field, SphereField
+// below. SCENE_BVH lays out BVH_FIELD_SIZE x BVH_FIELD_SIZE of the same
+// spheres as separate primitives and queries them through a BvhScene,
+// which BuildBvhScene() fills in. SCENE_CSG is the field put together
+// from Csg.hpp nodes as CsgField.
+#define SCENE_FIELD 0
+#define SCENE_BVH 1
+#define SCENE_CSG 2
+#ifndef SCENE
+#define SCENE SCENE_FIELD
+#endif
+#ifndef BVH_FIELD_SIZE
+#define BVH_FIELD_SIZE 32
+#endif
+
+BvhScene bvhScene;
+// Set when a scene file is given on the command line, and then used in
+// place of the scene chosen by SCENE
+SceneFile sceneFile;
+bool useSceneFile = false;
+
+// The hand-written scene. It is templated on the point type like the
+// nodes in Csg.hpp, so that points, packets and the dual numbers of the
+// gradients all run this same code. fmodf is replaced with floorv since
+// both operands are positive.
+struct SphereField {
+    template<class P> static CsgFloat<P> distance(P p, CsgFloat<P> &hitType) {
+        typedef CsgFloat<P> F;
+
+        // Infinite reflective spheres
+        F ax = absv(p.x);
+        F az = absv(p.z);
+        F x = ax - floorv(ax * 0.25f) * 4;
+        F z = az - floorv(az * 0.25f) * 4;
+        P displacement(F(2) - x, F(1) - p.y, F(2) - z);
+
+        F distance = displacement.magnitude() - 1;
+        hitType = 1;
+
+        // Glass sphere
+        P glass(F(0) - p.x, F(1) - p.y, F(0) - p.z);
+        F glassDist = glass.magnitude() - 1.5f;
+        hitType = blend(glassDist < distance, F(3), hitType);
+        distance = minv(glassDist, distance);
+
+        F floorDist = p.y;
+        hitType = blend(floorDist < distance, F(2), hitType);
+        distance = minv(floorDist, distance);
+
+        return distance;
+    }
+    template<class P> static CsgFloat<P> distance(P p) {
+        CsgFloat<P> hitType;
+        return distance(p, hitType);
+    }
+};
+
+typedef Union<
+    Material<1, Translate<2000, 1000, 2000, Repeat<4000, 0, 4000, Sphere<1000>>>>, // Infinite reflective spheres
+    Material<3, Translate<0, 1000, 0, Sphere<1500>>>,                            // Glass sphere
+    Material<2, Plane<0>>                                                        // Floor
+> CsgField;
+
+void BuildBvhScene() {
+    // Reflective spheres on the same 4 unit grid as the infinite field
+    for (int i = -BVH_FIELD_SIZE / 2; i < BVH_FIELD_SIZE / 2; i++) {
+        for (int j = -BVH_FIELD_SIZE / 2; j < BVH_FIELD_SIZE / 2; j++) {
+            bvhScene.add({ PRIMITIVE_SPHERE, Vector(i * 4 + 2, 1, j * 4 + 2), Vector(1), 1 });
+        }
+    }
+    bvhScene.add({ PRIMITIVE_SPHERE, Vector(0, 1, 0), Vector(1.5), 3 }); // Glass sphere
+    bvhScene.add({ PRIMITIVE_PLANE, Vector(0), Vector(0), 2 });         // Floor
+    bvhScene.build();
+}
+
+float GetDistance(Vector p, int &hitType) {
+    if (useSceneFile) return sceneFile.program.evaluate(p, hitType);
+    if (SCENE == SCENE_BVH) return bvhScene.distance(p, hitType);
+    if (SCENE == SCENE_CSG) return CsgDistance<CsgField>(p, hitType);
+    return CsgDistance<SphereField>(p, hitType);
+}
+
+void GetDistancePacket(const PointPacket &p, PacketFloat &distance, PacketFloat &hitType) {
+    if (useSceneFile) {
+        sceneFile.program.evaluate(p, distance, hitType);
+        return;
+    }
+    if (SCENE == SCENE_BVH) {
+        LanewiseDistance<GetDistance>(p, distance, hitType);
+        return;
+    }
+    if (SCENE == SCENE_CSG) {
+        CsgDistancePacket<CsgField>(p, distance, hitType);
+        return;
+    }
+    CsgDistancePacket<SphereField>(p, distance, hitType);
+}
+
+// Exact gradients by automatic differentiation
+void GetGradient(Vector p, Vector &gradient) {
+    if (useSceneFile) gradient = sceneFile.program.gradient(p);
+    else if (SCENE == SCENE_BVH) gradient = bvhScene.gradient(p);
+    else if (SCENE == SCENE_CSG) CsgGradient<CsgField>(p, gradient);
+    else CsgGradient<SphereField>(p, gradient);
+}
+
+void GetGradientPacket(const PointPacket &p, PointPacket &gradient) {
+    if (useSceneFile) gradient = sceneFile.program.gradient(p);
+    else if (SCENE == SCENE_BVH) LanewiseGradient<GetGradient>(p, gradient);
+    else if (SCENE == SCENE_CSG) CsgGradientPacket<CsgField>(p, gradient);
+    else CsgGradientPacket<SphereField>(p, gradient);
+}
+
+#endif // _SCENE_H
@@ -0,0 +1,256 @@
+#ifndef _SCENEFILE_H
+#define _SCENEFILE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <math.h>
+#include <string>
+#include <vector>
+#include "Vector.hpp"
+#include "SdfProgram.hpp"
+
+#define DEGREES 0.0174532925f
+
+// Text scene description, compiled into an SdfProgram when loaded.
+//
+//   # comment
+//   camera x y z azimuth zrot fov   angles in degrees
+//   material id                     for the primitives after it in the block
+//   sphere radius
+//   box halfX halfY halfZ
+//   plane height
+//   union ... end                   also intersect, subtract, smooth k
+//   translate x y z ... end
+//   rotate degrees ... end          about the y axis
+//   scale factor ... end
+//   repeat x y z ... end            period per axis, 0 to not repeat
+//
+// Operators fold their children from the left, so subtract removes all
+// later children from the first. Transform blocks and the file itself
+// are unions of their children.
+struct SceneFile {
+    SdfProgram program;
+
+    bool hasCamera = false;
+    Vector cameraPosition;
+    float cameraAzimuth = 0; // Radians
+    float cameraZRot = 0;    // Radians
+    float cameraFov = 90;    // Degrees
+
+    // Hash of the file's text, identifies the scene in saved caches
+    uint64_t hash = 0;
+};
+
+class SceneCompiler {
+public:
+    SceneCompiler(const char *path, SceneFile &scene) : path(path), scene(scene) {}
+
+    bool compile(const char *text) {
+        tokenize(text);
+        int count = 0;
+        while (ok && position < tokens.size()) {
+            if (tokens[position].word == "end") return fail("'end' without a block");
+            if (statement()) foldUnion(count++);
+        }
+        return ok;
+    }
+
+private:
+    struct Token {
+        std::string word;
+        int line;
+    };
+
+    const char *path;
+    SceneFile &scene;
+    std::vector<Token> tokens;
+    size_t position = 0;
+    int material = 1;
+    int stack = 0;
+    int pointStack = 0;
+    bool ok = true;
+
+    void tokenize(const char *text) {
+        int line = 1;
+        const char *c = text;
+        while (*c) {
+            if (*c == '#') {
+                while (*c && *c != '\n') c++;
+            } else if (isspace((unsigned char)*c)) {
+                if (*c == '\n') line++;
+                c++;
+            } else {
+                const char *start = c;
+                while (*c && !isspace((unsigned char)*c) && *c != '#') c++;
+                tokens.push_back({ std::string(start, c), line });
+            }
+        }
+    }
+
+    bool fail(const char *message) {
+        if (ok) {
+            int line = position < tokens.size() ? tokens[position].line : (tokens.empty() ? 1 : tokens.back().line);
+            printf("%s:%d: %s\n", path, line, message);
+        }
+        ok = false;
+        return false;
+    }
+
+    float number() {
+        if (position >= tokens.size()) {
+            fail("expected a number");
+            return 0;
+        }
+        const char *word = tokens[position].word.c_str();
+        char *end;
+        float value = strtof(word, &end);
+        if (end == word || *end) {
+            fail("expected a number");
+            return 0;
+        }
+        position++;
+        return value;
+    }
+
+    void emit(int op, float a=0, float b=0, float c=0) {
+        scene.program.code.push_back({ (uint16_t)op, (uint16_t)material, a, b, c });
+    }
+
+    void push() {
+        if (++stack > SDF_MAX_STACK) fail("scene is nested too deeply");
+    }
+    void pushPoint() {
+        if (++pointStack > SDF_MAX_STACK) fail("too many nested transforms");
+    }
+
+    // Unions the value just pushed into the one below it, unless it is
+    // the first of its block
+    void foldUnion(int index) {
+        if (index == 0) return;
+        emit(SDF_UNION);
+        stack--;
+    }
+
+    // Compiles children until 'end'. Each is combined into the first
+    // with op. Returns how many pushed a value.
+    int block(int op, float a=0) {
+        int savedMaterial = material;
+        int count = 0;
+        while (ok) {
+            if (position >= tokens.size()) {
+                fail("missing 'end'");
+                break;
+            }
+            if (tokens[position].word == "end") {
+                position++;
+                break;
+            }
+            if (!statement()) continue;
+            if (count++ > 0) {
+                emit(op, a);
+                stack--;
+            }
+        }
+        material = savedMaterial;
+        return count;
+    }
+
+    // Compiles one statement. Returns whether it pushed a value.
+    bool statement() {
+        const Token &token = tokens[position++];
+        const std::string &w = token.word;
+
+        if (w == "camera") {
+            scene.hasCamera = true;
+            float x = number(), y = number(), z = number();
+            scene.cameraPosition = Vector(x, y, z);
+            scene.cameraAzimuth = number() * DEGREES;
+            scene.cameraZRot = number() * DEGREES;
+            scene.cameraFov = number();
+            return false;
+        }
+        if (w == "material") {
+            float id = number();
+            if (id < 0 || id > 65535 || id != floorf(id)) return fail("material must be a whole number");
+            material = (int)id;
+            return false;
+        }
+
+        if (w == "sphere") {
+            emit(SDF_SPHERE, number());
+        } else if (w == "box") {
+            float x = number(), y = number(), z = number();
+            emit(SDF_BOX, x, y, z);
+        } else if (w == "plane") {
+            emit(SDF_PLANE, number());
+        } else if (w == "union" || w == "intersect" || w == "subtract" || w == "smooth") {
+            int op = w == "union" ? SDF_UNION : w == "intersect" ? SDF_INTERSECT : w == "subtract" ? SDF_SUBTRACT : SDF_SMOOTH_UNION;
+            float k = 0;
+            if (op == SDF_SMOOTH_UNION) {
+                k = number();
+                if (ok && k <= 0) return fail("smooth radius must be positive");
+            }
+            if (block(op, k) == 0) return fail("empty block");
+            return true;
+        } else if (w == "translate" || w == "rotate" || w == "scale" || w == "repeat") {
+            float a = number(), b = 0, c = 0;
+            if (w == "translate" || w == "repeat") {
+                b = number();
+                c = number();
+            }
+            if (w == "translate") {
+                emit(SDF_TRANSLATE, a, b, c);
+            } else if (w == "rotate") {
+                // Points are rotated the opposite way to the shape
+                float angle = -a * DEGREES;
+                emit(SDF_ROTATE_Y, cosf(angle), sinf(angle));
+            } else if (w == "scale") {
+                if (ok && a <= 0) return fail("scale must be positive");
+                emit(SDF_SCALE, a);
+            } else {
+                if (ok && (a < 0 || b < 0 || c < 0)) return fail("repeat periods must not be negative");
+                emit(SDF_REPEAT, a, b, c);
+            }
+            pushPoint();
+            int count = block(SDF_UNION);
+            pointStack--;
+            if (count == 0) return fail("empty block");
+            if (w == "scale") emit(SDF_UNSCALE, a);
+            emit(SDF_POP_POINT);
+            return true;
+        } else {
+            position--;
+            std::string message = "unknown keyword '" + w + "'";
+            fail(message.c_str());
+            position++;
+            return false;
+        }
+        push();
+        return true;
+    }
+};
+
+// Reads and compiles a scene file. Prints the problem and returns false
+// if the file can't be read or has an error.
+bool LoadScene(const char *path, SceneFile &scene) {
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        printf("Could not open %s.\n", path);
+        return false;
+    }
+    std::string text;
+    char buffer[4096];
+    size_t read;
+    while ((read = fread(buffer, 1, sizeof(buffer), file)) > 0) text.append(buffer, read);
+    fclose(file);
+
+    scene = SceneFile();
+    // FNV-1a
+    scene.hash = 14695981039346656037ull;
+    for (char c : text) scene.hash = (scene.hash ^ (uint8_t)c) * 1099511628211ull;
+    SceneCompiler compiler(path, scene);
+    return compiler.compile(text.c_str());
+}
+
+#endif // _SCENEFILE_H
@@ -0,0 +1,160 @@
+#ifndef _SCHEDULER_H
+#define _SCHEDULER_H
+
+#include <atomic>
+#include <vector>
+#include <algorithm>
+#include <math.h>
+#include <stdint.h>
+
+// Order in which tiles are handed out
+#define TILE_ORDER_ROWS 0   // left to right, top to bottom
+#define TILE_ORDER_SPIRAL 1 // outwards from the center of the image
+#define TILE_ORDER_MORTON 2 // Z-order curve, keeps neighbouring tiles together
+
+struct Tile {
+    int x, y; // Top-left pixel
+};
+
+// Hands out tiles to a fixed number of workers without a global lock.
+// The ordered tile list is split into one contiguous run per worker.
+// A worker takes tiles from the front of its own run, and once that is
+// empty it steals single tiles from the back of the other runs. Each run
+// is a (begin, end) pair packed into one atomic so both ends can be
+// claimed with a compare-and-swap.
+class TileScheduler {
+public:
+    TileScheduler(int width, int height, int tileWidth, int tileHeight, int workers, int order=TILE_ORDER_ROWS)
+        : runs(workers), tileWidth(tileWidth), tileHeight(tileHeight)
+    {
+        wCount = (width + tileWidth - 1) / tileWidth;
+        int hCount = (height + tileHeight - 1) / tileHeight;
+        for (int ty = 0; ty < hCount; ty++) {
+            for (int tx = 0; tx < wCount; tx++) {
+                tiles.push_back({ tx * tileWidth, ty * tileHeight });
+            }
+        }
+        sortTiles(wCount, hCount, tileWidth, tileHeight, order);
+        reset();
+    }
+
+    int tileCount() const { return tiles.size(); }
+
+    // Position of a tile in row-major order, whatever order the tiles
+    // are handed out in
+    int index(const Tile &tile) const { return tile.y / tileHeight * wCount + tile.x / tileWidth; }
+
+    // Makes every tile available again, for renders that go over the
+    // image in several passes. Tiles whose entry in skip (by index()) is
+    // set are left out. Must not race with next().
+    void reset(const std::vector<char> *skip=nullptr) {
+        active.clear();
+        for (int i = 0; i < (int)tiles.size(); i++) {
+            if (!skip || !(*skip)[index(tiles[i])]) active.push_back(i);
+        }
+        stopped.store(false);
+        int count = active.size();
+        int workers = runs.size();
+        for (int i = 0; i < workers; i++) {
+            uint32_t begin = (uint64_t)count * i / workers;
+            uint32_t end = (uint64_t)count * (i + 1) / workers;
+            runs[i].range.store(pack(begin, end));
+        }
+    }
+
+    // Fetches the next tile for the given worker. Returns false once
+    // every tile has been handed out, or after stop().
+    bool next(int worker, Tile &tile) {
+        if (stopped.load(std::memory_order_relaxed)) return false;
+        int i;
+        if (takeFront(runs[worker].range, i)) {
+            tile = tiles[active[i]];
+            return true;
+        }
+        for (int r = 1; r < (int)runs.size(); r++) {
+            int victim = (worker + r) % runs.size();
+            if (takeBack(runs[victim].range, i)) {
+                tile = tiles[active[i]];
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Hands out no more tiles until the next reset, so the workers finish
+    // the ones they have and stop, e.g. to save a checkpoint
+    void stop() { stopped.store(true); }
+
+private:
+    // Padded so neighbouring runs never share a cache line
+    struct alignas(64) Run {
+        std::atomic<uint64_t> range;
+    };
+
+    std::vector<Tile> tiles;
+    std::vector<int> active; // Tiles taking part in this pass
+    std::vector<Run> runs;
+    std::atomic<bool> stopped{false};
+    int tileWidth, tileHeight, wCount;
+
+    static uint64_t pack(uint32_t begin, uint32_t end) { return (uint64_t)begin << 32 | end; }
+    static uint32_t begin(uint64_t range) { return range >> 32; }
+    static uint32_t end(uint64_t range) { return (uint32_t)range; }
+
+    static bool takeFront(std::atomic<uint64_t> &range, int &index) {
+        uint64_t r = range.load();
+        while (begin(r) < end(r)) {
+            if (range.compare_exchange_weak(r, pack(begin(r) + 1, end(r)))) {
+                index = begin(r);
+                return true;
+            }
+        }
+        return false;
+    }
+    static bool takeBack(std::atomic<uint64_t> &range, int &index) {
+        uint64_t r = range.load();
+        while (begin(r) < end(r)) {
+            if (range.compare_exchange_weak(r, pack(begin(r), end(r) - 1))) {
+                index = end(r) - 1;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static uint32_t morton(uint32_t x, uint32_t y) {
+        uint32_t code = 0;
+        for (int bit = 0; bit < 16; bit++) {
+            code |= ((x >> bit) & 1) << (2 * bit);
+            code |= ((y >> bit) & 1) << (2 * bit + 1);
+        }
+        return code;
+    }
+
+    void sortTiles(int wCount, int hCount, int tileWidth, int tileHeight, int order) {
+        std::vector<std::pair<double, Tile>> keyed;
+        for (Tile t : tiles) {
+            int tx = t.x / tileWidth;
+            int ty = t.y / tileHeight;
+            double key;
+            if (order == TILE_ORDER_SPIRAL) {
+                // Rings of equal Chebyshev distance from the center,
+                // walked by angle so each ring is contiguous
+                float cx = tx - (wCount - 1) * 0.5f;
+                float cy = ty - (hCount - 1) * 0.5f;
+                float ring = fabsf(cx) > fabsf(cy) ? fabsf(cx) : fabsf(cy);
+                key = ring * 8 + atan2f(cy, cx) / 3.14159265f + 1;
+            } else if (order == TILE_ORDER_MORTON) {
+                key = morton(tx, ty);
+            } else {
+                key = ty * wCount + tx;
+            }
+            keyed.push_back({ key, t });
+        }
+        std::stable_sort(keyed.begin(), keyed.end(),
+            [](const std::pair<double, Tile> &a, const std::pair<double, Tile> &b) { return a.first < b.first; });
+        for (int i = 0; i < (int)keyed.size(); i++) tiles[i] = keyed[i].second;
+    }
+};
+
+#endif // _SCHEDULER_H
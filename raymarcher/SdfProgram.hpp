@@ -0,0 +1,171 @@
+#ifndef _SDFPROGRAM_H
+#define _SDFPROGRAM_H
+
+#include <math.h>
+#include <stdint.h>
+#include <vector>
+#include "Vector.hpp"
+#include "RayPacket.hpp"
+#include "Dual.hpp"
+
+// Instructions of the distance bytecode. The program runs on a stack of
+// (distance, material) pairs: primitives push one, CSG operators pop two
+// and push the result. Transforms save the current point on a second
+// stack and change it for the instructions that follow, up to the
+// matching SDF_POP_POINT.
+#define SDF_SPHERE 0       // a = radius
+#define SDF_BOX 1          // a, b, c = half extents
+#define SDF_PLANE 2        // horizontal, a = height
+#define SDF_UNION 3
+#define SDF_INTERSECT 4
+#define SDF_SUBTRACT 5     // first operand minus the second
+#define SDF_SMOOTH_UNION 6 // a = blend radius
+#define SDF_TRANSLATE 7    // a, b, c = offset
+#define SDF_ROTATE_Y 8     // a, b = cosine and sine of the angle
+#define SDF_SCALE 9        // a = factor
+#define SDF_UNSCALE 10     // a = factor, applied to the distance on top
+#define SDF_REPEAT 11      // a, b, c = period per axis, 0 to not repeat
+#define SDF_POP_POINT 12
+
+// Deepest either stack may get
+#define SDF_MAX_STACK 32
+
+struct SdfInstruction {
+    uint16_t op;
+    uint16_t material;
+    float a, b, c;
+};
+
+// Compiled signed distance function. Built by LoadScene in SceneFile.hpp.
+class SdfProgram {
+public:
+    std::vector<SdfInstruction> code;
+
+    float evaluate(Vector p, int &material) const {
+        float distance, type;
+        run<Vector, float>(p, distance, type);
+        material = (int)type;
+        return distance;
+    }
+
+    void evaluate(const PointPacket &p, PacketFloat &distance, PacketFloat &material) const {
+        run<PointPacket, PacketFloat>(p, distance, material);
+    }
+
+    Vector gradient(Vector p) const {
+        Dual<float> distance, material;
+        run<DualVector<float>, Dual<float>>(DualVector<float>::variable(p), distance, material);
+        return Vector(distance.dx, distance.dy, distance.dz);
+    }
+
+    PointPacket gradient(const PointPacket &p) const {
+        Dual<PacketFloat> distance, material;
+        run<DualVector<PacketFloat>, Dual<PacketFloat>>(DualVector<PacketFloat>::variable(p), distance, material);
+        return PointPacket(distance.dx, distance.dy, distance.dz);
+    }
+
+    // Evaluates count points, a packet at a time
+    void evaluate(const Vector *points, int count, float *distance, int *material) const {
+        int i = 0;
+        for (; i + PACKET_WIDTH <= count; i += PACKET_WIDTH) {
+            PointPacket p;
+            for (int lane = 0; lane < PACKET_WIDTH; lane++) p.set(lane, points[i + lane]);
+            PacketFloat d, type;
+            evaluate(p, d, type);
+            for (int lane = 0; lane < PACKET_WIDTH; lane++) {
+                distance[i + lane] = d[lane];
+                material[i + lane] = (int)type[lane];
+            }
+        }
+        for (; i < count; i++) distance[i] = evaluate(points[i], material[i]);
+    }
+
+private:
+    template<class Point, class Float>
+    void run(Point p, Float &distance, Float &material) const {
+        Float d[SDF_MAX_STACK];
+        Float m[SDF_MAX_STACK];
+        Point saved[SDF_MAX_STACK];
+        int top = 0;
+        int savedTop = 0;
+
+        for (const SdfInstruction &in : code) {
+            switch (in.op) {
+            case SDF_SPHERE:
+                d[top] = p.magnitude() - in.a;
+                m[top++] = in.material;
+                break;
+            case SDF_BOX: {
+                Float qx = absv(p.x) - in.a;
+                Float qy = absv(p.y) - in.b;
+                Float qz = absv(p.z) - in.c;
+                Point outside(maxv(qx, 0), maxv(qy, 0), maxv(qz, 0));
+                d[top] = outside.magnitude() + minv(maxv(qx, maxv(qy, qz)), 0);
+                m[top++] = in.material;
+                break;
+            }
+            case SDF_PLANE:
+                d[top] = p.y - in.a;
+                m[top++] = in.material;
+                break;
+            case SDF_UNION:
+                top--;
+                m[top - 1] = blend(d[top] < d[top - 1], m[top], m[top - 1]);
+                d[top - 1] = minv(d[top], d[top - 1]);
+                break;
+            case SDF_INTERSECT:
+                top--;
+                m[top - 1] = blend(d[top] > d[top - 1], m[top], m[top - 1]);
+                d[top - 1] = maxv(d[top], d[top - 1]);
+                break;
+            case SDF_SUBTRACT:
+                top--;
+                d[top - 1] = maxv(d[top - 1], Float(0) - d[top]);
+                break;
+            case SDF_SMOOTH_UNION: {
+                // Polynomial smooth minimum
+                top--;
+                Float a = d[top - 1], b = d[top];
+                Float h = minv(maxv((b - a) * (0.5f / in.a) + 0.5f, 0), 1);
+                m[top - 1] = blend(b < a, m[top], m[top - 1]);
+                d[top - 1] = b + (a - b) * h - h * (Float(1) - h) * in.a;
+                break;
+            }
+            case SDF_TRANSLATE:
+                saved[savedTop++] = p;
+                p = Point(p.x - in.a, p.y - in.b, p.z - in.c);
+                break;
+            case SDF_ROTATE_Y:
+                saved[savedTop++] = p;
+                p = Point(p.x * in.a - p.z * in.b, p.y, p.x * in.b + p.z * in.a);
+                break;
+            case SDF_SCALE:
+                saved[savedTop++] = p;
+                p = p * (1 / in.a);
+                break;
+            case SDF_UNSCALE:
+                d[top - 1] = d[top - 1] * in.a;
+                break;
+            case SDF_REPEAT:
+                saved[savedTop++] = p;
+                if (in.a > 0) p.x = p.x - floorv(p.x * (1 / in.a) + 0.5f) * in.a;
+                if (in.b > 0) p.y = p.y - floorv(p.y * (1 / in.b) + 0.5f) * in.b;
+                if (in.c > 0) p.z = p.z - floorv(p.z * (1 / in.c) + 0.5f) * in.c;
+                break;
+            case SDF_POP_POINT:
+                p = saved[--savedTop];
+                break;
+            }
+        }
+
+        if (top == 0) {
+            distance = 1e9;
+            material = 0;
+        } else {
+            distance = d[0];
+            material = m[0];
+        }
+    }
+};
+
+#endif // _SDFPROGRAM_H
@@ -0,0 +1,437 @@
+#ifndef _VECTORN_H
+#define _VECTORN_H
+
+#include <math.h>
+#include "Vector.hpp"
+
+#if defined(__AVX__) || defined(__AVX512F__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#ifdef __SSE4_1__
+#include <smmintrin.h>
+#endif
+#endif
+
+// Structure-of-arrays companion to Vector. VectorN<W> holds W vectors,
+// one per lane, and supports the same operators so a kernel written
+// against it runs on W points at once. Comparisons produce a MaskN
+// which picks lanes with blend().
+//
+// FloatN and MaskN are plain loops over float arrays for any W, which
+// the compiler is free to auto-vectorize. W = 4 with SSE2, W = 8 with
+// AVX and W = 16 with AVX-512 are specialized onto intrinsics.
+
+// Widest lane count the compiler is targeting
+#if defined(__AVX512F__)
+#define VECTOR_LANES 16
+#elif defined(__AVX__)
+#define VECTOR_LANES 8
+#else
+#define VECTOR_LANES 4
+#endif
+
+template<int W>
+struct MaskN {
+    bool m[W];
+
+    MaskN(bool a=false) { for (int i = 0; i < W; i++) m[i] = a; }
+
+    friend MaskN operator&(MaskN a, MaskN b) {
+        MaskN r;
+        for (int i = 0; i < W; i++) r.m[i] = a.m[i] && b.m[i];
+        return r;
+    }
+    friend MaskN operator|(MaskN a, MaskN b) {
+        MaskN r;
+        for (int i = 0; i < W; i++) r.m[i] = a.m[i] || b.m[i];
+        return r;
+    }
+    MaskN operator~() const {
+        MaskN r;
+        for (int i = 0; i < W; i++) r.m[i] = !m[i];
+        return r;
+    }
+
+    bool operator[](int lane) const { return m[lane]; }
+    int count() const {
+        int c = 0;
+        for (int i = 0; i < W; i++) c += m[i];
+        return c;
+    }
+    bool any() const { return count() != 0; }
+    bool all() const { return count() == W; }
+};
+
+template<int W>
+struct FloatN {
+    float v[W];
+
+    FloatN(float a=0) { for (int i = 0; i < W; i++) v[i] = a; }
+
+    static FloatN load(const float *p) {
+        FloatN r;
+        for (int i = 0; i < W; i++) r.v[i] = p[i];
+        return r;
+    }
+    void store(float *p) const { for (int i = 0; i < W; i++) p[i] = v[i]; }
+
+    float operator[](int lane) const { return v[lane]; }
+    void set(int lane, float a) { v[lane] = a; }
+
+#define _FLOATN_OP(op) \
+    friend FloatN operator op(FloatN a, FloatN b) { \
+        FloatN r; \
+        for (int i = 0; i < W; i++) r.v[i] = a.v[i] op b.v[i]; \
+        return r; \
+    }
+    _FLOATN_OP(+)
+    _FLOATN_OP(-)
+    _FLOATN_OP(*)
+    _FLOATN_OP(/)
+#undef _FLOATN_OP
+
+#define _FLOATN_CMP(op) \
+    friend MaskN<W> operator op(FloatN a, FloatN b) { \
+        MaskN<W> r; \
+        for (int i = 0; i < W; i++) r.m[i] = a.v[i] op b.v[i]; \
+        return r; \
+    }
+    _FLOATN_CMP(<)
+    _FLOATN_CMP(>)
+    _FLOATN_CMP(<=)
+    _FLOATN_CMP(>=)
+#undef _FLOATN_CMP
+
+    FloatN operator-() const { return FloatN(0) - *this; }
+
+    friend FloatN blend(MaskN<W> m, FloatN a, FloatN b) {
+        FloatN r;
+        for (int i = 0; i < W; i++) r.v[i] = m.m[i] ? a.v[i] : b.v[i];
+        return r;
+    }
+    friend FloatN sqrtv(FloatN a) {
+        for (int i = 0; i < W; i++) a.v[i] = sqrtf(a.v[i]);
+        return a;
+    }
+    friend FloatN absv(FloatN a) {
+        for (int i = 0; i < W; i++) a.v[i] = fabsf(a.v[i]);
+        return a;
+    }
+    friend FloatN floorv(FloatN a) {
+        for (int i = 0; i < W; i++) a.v[i] = floorf(a.v[i]);
+        return a;
+    }
+    friend FloatN minv(FloatN a, FloatN b) {
+        for (int i = 0; i < W; i++) a.v[i] = a.v[i] < b.v[i] ? a.v[i] : b.v[i];
+        return a;
+    }
+    friend FloatN maxv(FloatN a, FloatN b) {
+        for (int i = 0; i < W; i++) a.v[i] = a.v[i] > b.v[i] ? a.v[i] : b.v[i];
+        return a;
+    }
+};
+
+#if defined(__SSE2__)
+template<>
+struct MaskN<4> {
+    __m128 m;
+
+    MaskN(bool a=false) { m = _mm_castsi128_ps(_mm_set1_epi32(a ? -1 : 0)); }
+    MaskN(__m128 a) : m(a) {}
+
+    friend MaskN operator&(MaskN a, MaskN b) { return _mm_and_ps(a.m, b.m); }
+    friend MaskN operator|(MaskN a, MaskN b) { return _mm_or_ps(a.m, b.m); }
+    MaskN operator~() const { return _mm_xor_ps(m, MaskN(true).m); }
+
+    bool operator[](int lane) const { return (_mm_movemask_ps(m) >> lane) & 1; }
+    int count() const { return __builtin_popcount(_mm_movemask_ps(m)); }
+    bool any() const { return _mm_movemask_ps(m) != 0; }
+    bool all() const { return _mm_movemask_ps(m) == 0xf; }
+};
+
+template<>
+struct FloatN<4> {
+    __m128 v;
+
+    FloatN(float a=0) { v = _mm_set1_ps(a); }
+    FloatN(__m128 a) : v(a) {}
+
+    static FloatN load(const float *p) { return _mm_loadu_ps(p); }
+    void store(float *p) const { _mm_storeu_ps(p, v); }
+
+    float operator[](int lane) const {
+        alignas(16) float a[4];
+        _mm_store_ps(a, v);
+        return a[lane];
+    }
+    void set(int lane, float a) {
+        alignas(16) float t[4];
+        _mm_store_ps(t, v);
+        t[lane] = a;
+        v = _mm_load_ps(t);
+    }
+
+    friend FloatN operator+(FloatN a, FloatN b) { return _mm_add_ps(a.v, b.v); }
+    friend FloatN operator-(FloatN a, FloatN b) { return _mm_sub_ps(a.v, b.v); }
+    friend FloatN operator*(FloatN a, FloatN b) { return _mm_mul_ps(a.v, b.v); }
+    friend FloatN operator/(FloatN a, FloatN b) { return _mm_div_ps(a.v, b.v); }
+
+    friend MaskN<4> operator<(FloatN a, FloatN b) { return _mm_cmplt_ps(a.v, b.v); }
+    friend MaskN<4> operator>(FloatN a, FloatN b) { return _mm_cmpgt_ps(a.v, b.v); }
+    friend MaskN<4> operator<=(FloatN a, FloatN b) { return _mm_cmple_ps(a.v, b.v); }
+    friend MaskN<4> operator>=(FloatN a, FloatN b) { return _mm_cmpge_ps(a.v, b.v); }
+
+    FloatN operator-() const { return _mm_xor_ps(v, _mm_set1_ps(-0.f)); }
+
+    friend FloatN blend(MaskN<4> m, FloatN a, FloatN b) {
+        return _mm_or_ps(_mm_and_ps(m.m, a.v), _mm_andnot_ps(m.m, b.v));
+    }
+    friend FloatN sqrtv(FloatN a) { return _mm_sqrt_ps(a.v); }
+    friend FloatN absv(FloatN a) { return _mm_andnot_ps(_mm_set1_ps(-0.f), a.v); }
+    friend FloatN floorv(FloatN a) {
+#ifdef __SSE4_1__
+        return _mm_floor_ps(a.v);
+#else
+        // Truncate, then step down the lanes that were rounded up
+        __m128 t = _mm_cvtepi32_ps(_mm_cvttps_epi32(a.v));
+        return _mm_sub_ps(t, _mm_and_ps(_mm_cmpgt_ps(t, a.v), _mm_set1_ps(1)));
+#endif
+    }
+    friend FloatN minv(FloatN a, FloatN b) { return _mm_min_ps(a.v, b.v); }
+    friend FloatN maxv(FloatN a, FloatN b) { return _mm_max_ps(a.v, b.v); }
+};
+#endif
+
+#if defined(__AVX__)
+template<>
+struct MaskN<8> {
+    __m256 m;
+
+    MaskN(bool a=false) { m = _mm256_castsi256_ps(_mm256_set1_epi32(a ? -1 : 0)); }
+    MaskN(__m256 a) : m(a) {}
+
+    friend MaskN operator&(MaskN a, MaskN b) { return _mm256_and_ps(a.m, b.m); }
+    friend MaskN operator|(MaskN a, MaskN b) { return _mm256_or_ps(a.m, b.m); }
+    MaskN operator~() const { return _mm256_xor_ps(m, MaskN(true).m); }
+
+    bool operator[](int lane) const { return (_mm256_movemask_ps(m) >> lane) & 1; }
+    int count() const { return __builtin_popcount(_mm256_movemask_ps(m)); }
+    bool any() const { return _mm256_movemask_ps(m) != 0; }
+    bool all() const { return _mm256_movemask_ps(m) == 0xff; }
+};
+
+template<>
+struct FloatN<8> {
+    __m256 v;
+
+    FloatN(float a=0) { v = _mm256_set1_ps(a); }
+    FloatN(__m256 a) : v(a) {}
+
+    static FloatN load(const float *p) { return _mm256_loadu_ps(p); }
+    void store(float *p) const { _mm256_storeu_ps(p, v); }
+
+    float operator[](int lane) const {
+        alignas(32) float a[8];
+        _mm256_store_ps(a, v);
+        return a[lane];
+    }
+    void set(int lane, float a) {
+        alignas(32) float t[8];
+        _mm256_store_ps(t, v);
+        t[lane] = a;
+        v = _mm256_load_ps(t);
+    }
+
+    friend FloatN operator+(FloatN a, FloatN b) { return _mm256_add_ps(a.v, b.v); }
+    friend FloatN operator-(FloatN a, FloatN b) { return _mm256_sub_ps(a.v, b.v); }
+    friend FloatN operator*(FloatN a, FloatN b) { return _mm256_mul_ps(a.v, b.v); }
+    friend FloatN operator/(FloatN a, FloatN b) { return _mm256_div_ps(a.v, b.v); }
+
+    friend MaskN<8> operator<(FloatN a, FloatN b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ); }
+    friend MaskN<8> operator>(FloatN a, FloatN b) { return _mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ); }
+    friend MaskN<8> operator<=(FloatN a, FloatN b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ); }
+    friend MaskN<8> operator>=(FloatN a, FloatN b) { return _mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ); }
+
+    FloatN operator-() const { return _mm256_xor_ps(v, _mm256_set1_ps(-0.f)); }
+
+    friend FloatN blend(MaskN<8> m, FloatN a, FloatN b) { return _mm256_blendv_ps(b.v, a.v, m.m); }
+    friend FloatN sqrtv(FloatN a) { return _mm256_sqrt_ps(a.v); }
+    friend FloatN absv(FloatN a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.f), a.v); }
+    friend FloatN floorv(FloatN a) { return _mm256_floor_ps(a.v); }
+    friend FloatN minv(FloatN a, FloatN b) { return _mm256_min_ps(a.v, b.v); }
+    friend FloatN maxv(FloatN a, FloatN b) { return _mm256_max_ps(a.v, b.v); }
+};
+#endif
+
+#if defined(__AVX512F__)
+template<>
+struct MaskN<16> {
+    __mmask16 m;
+
+    MaskN(bool a=false) { m = a ? 0xffff : 0; }
+    MaskN(__mmask16 a) : m(a) {}
+
+    friend MaskN operator&(MaskN a, MaskN b) { return (__mmask16)(a.m & b.m); }
+    friend MaskN operator|(MaskN a, MaskN b) { return (__mmask16)(a.m | b.m); }
+    MaskN operator~() const { return (__mmask16)~m; }
+
+    bool operator[](int lane) const { return (m >> lane) & 1; }
+    int count() const { return __builtin_popcount(m); }
+    bool any() const { return m != 0; }
+    bool all() const { return m == 0xffff; }
+};
+
+template<>
+struct FloatN<16> {
+    __m512 v;
+
+    FloatN(float a=0) { v = _mm512_set1_ps(a); }
+    FloatN(__m512 a) : v(a) {}
+
+    static FloatN load(const float *p) { return _mm512_loadu_ps(p); }
+    void store(float *p) const { _mm512_storeu_ps(p, v); }
+
+    float operator[](int lane) const {
+        alignas(64) float a[16];
+        _mm512_store_ps(a, v);
+        return a[lane];
+    }
+    void set(int lane, float a) { v = _mm512_mask_mov_ps(v, (__mmask16)(1 << lane), _mm512_set1_ps(a)); }
+
+    friend FloatN operator+(FloatN a, FloatN b) { return _mm512_add_ps(a.v, b.v); }
+    friend FloatN operator-(FloatN a, FloatN b) { return _mm512_sub_ps(a.v, b.v); }
+    friend FloatN operator*(FloatN a, FloatN b) { return _mm512_mul_ps(a.v, b.v); }
+    friend FloatN operator/(FloatN a, FloatN b) { return _mm512_div_ps(a.v, b.v); }
+
+    friend MaskN<16> operator<(FloatN a, FloatN b) { return _mm512_cmp_ps_mask(a.v, b.v, _CMP_LT_OQ); }
+    friend MaskN<16> operator>(FloatN a, FloatN b) { return _mm512_cmp_ps_mask(a.v, b.v, _CMP_GT_OQ); }
+    friend MaskN<16> operator<=(FloatN a, FloatN b) { return _mm512_cmp_ps_mask(a.v, b.v, _CMP_LE_OQ); }
+    friend MaskN<16> operator>=(FloatN a, FloatN b) { return _mm512_cmp_ps_mask(a.v, b.v, _CMP_GE_OQ); }
+
+    FloatN operator-() const { return _mm512_sub_ps(_mm512_setzero_ps(), v); }
+
+    friend FloatN blend(MaskN<16> m, FloatN a, FloatN b) { return _mm512_mask_blend_ps(m.m, b.v, a.v); }
+    friend FloatN sqrtv(FloatN a) { return _mm512_sqrt_ps(a.v); }
+    friend FloatN absv(FloatN a) { return _mm512_abs_ps(a.v); }
+    friend FloatN floorv(FloatN a) { return _mm512_roundscale_ps(a.v, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC); }
+    friend FloatN minv(FloatN a, FloatN b) { return _mm512_min_ps(a.v, b.v); }
+    friend FloatN maxv(FloatN a, FloatN b) { return _mm512_max_ps(a.v, b.v); }
+};
+#endif
+
+template<int W>
+struct VectorN {
+    FloatN<W> x, y, z;
+    VectorN(FloatN<W> a=0) { x = y = z = a; }
+    VectorN(FloatN<W> a, FloatN<W> b, FloatN<W> c) {
+        x = a;
+        y = b;
+        z = c;
+    }
+    // Broadcast the same vector to every lane
+    VectorN(Vector a) {
+        x = a.x;
+        y = a.y;
+        z = a.z;
+    }
+
+    Vector operator[](int lane) const {
+        return Vector(x[lane], y[lane], z[lane]);
+    }
+    void set(int lane, Vector a) {
+        x.set(lane, a.x);
+        y.set(lane, a.y);
+        z.set(lane, a.z);
+    }
+
+    friend VectorN operator+(VectorN a, VectorN b) {
+        return VectorN(a.x + b.x, a.y + b.y, a.z + b.z);
+    }
+    friend VectorN operator+(VectorN a, FloatN<W> b) {
+        return VectorN(a.x + b, a.y + b, a.z + b);
+    }
+    friend VectorN operator+(FloatN<W> b, VectorN a) {
+        return VectorN(a.x + b, a.y + b, a.z + b);
+    }
+    friend VectorN operator-(VectorN a, VectorN b) {
+        return VectorN(a.x - b.x, a.y - b.y, a.z - b.z);
+    }
+    friend VectorN operator-(VectorN a, FloatN<W> b) {
+        return VectorN(a.x - b, a.y - b, a.z - b);
+    }
+    friend VectorN operator-(FloatN<W> a, VectorN b) {
+        return VectorN(a - b.x, a - b.y, a - b.z);
+    }
+
+    friend VectorN operator*(VectorN a, VectorN b) {
+        return VectorN(a.x * b.x, a.y * b.y, a.z * b.z);
+    }
+    friend VectorN operator*(VectorN a, FloatN<W> b) {
+        return VectorN(a.x * b, a.y * b, a.z * b);
+    }
+    friend VectorN operator*(FloatN<W> b, VectorN a) {
+        return VectorN(a.x * b, a.y * b, a.z * b);
+    }
+    friend VectorN operator/(VectorN a, VectorN b) {
+        return VectorN(a.x / b.x, a.y / b.y, a.z / b.z);
+    }
+    friend VectorN operator/(VectorN a, FloatN<W> b) {
+        return a * (FloatN<W>(1) / b);
+    }
+    friend VectorN operator/(FloatN<W> a, VectorN b) {
+        return VectorN(a / b.x, a / b.y, a / b.z);
+    }
+
+    FloatN<W> operator%(VectorN o) const {
+        return x * o.x + y * o.y + z * o.z;
+    }
+    FloatN<W> sqrMagnitude() const {
+        return *this % *this;
+    }
+    FloatN<W> magnitude() const {
+        return sqrtv(*this % *this);
+    }
+
+    VectorN operator-() const {
+        return VectorN(-x, -y, -z);
+    }
+    VectorN operator!() const {
+        return *this / sqrtv(*this % *this);
+    }
+
+    VectorN cross(VectorN o) const {
+        return VectorN(
+            y * o.z - z * o.y,
+            z * o.x - x * o.z,
+            x * o.y - y * o.x
+        );
+    }
+
+    FloatN<W> angleTo(VectorN b) const {
+        FloatN<W> c = *this % b;
+        for (int i = 0; i < W; i++) c.set(i, acosf(c[i]));
+        return c;
+    }
+
+    friend VectorN blend(MaskN<W> m, VectorN a, VectorN b) {
+        return VectorN(blend(m, a.x, b.x), blend(m, a.y, b.y), blend(m, a.z, b.z));
+    }
+};
+
+template<int W>
+VectorN<W> powv(VectorN<W> v, float p) {
+    for (int i = 0; i < W; i++) v.set(i, powv(v[i], p));
+    return v;
+}
+
+// Scalar forms of the FloatN lane functions, so code templated on the
+// point type runs on both Vector and VectorN
+float absv(float a) { return fabsf(a); }
+float floorv(float a) { return floorf(a); }
+float sqrtv(float a) { return sqrtf(a); }
+float minv(float a, float b) { return fminf(a, b); }
+float maxv(float a, float b) { return fmaxf(a, b); }
+float blend(bool m, float a, float b) { return m ? a : b; }
+
+#endif
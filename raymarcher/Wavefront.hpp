@@ -0,0 +1,171 @@
+#ifndef _WAVEFRONT_H
+#define _WAVEFRONT_H
+
+#include <vector>
+#include <algorithm>
+#include "Vector.hpp"
+#include "Ray.hpp"
+#include "RayPacket.hpp"
+#include "Sampler.hpp"
+#include "DistanceCache.hpp"
+#include "Heatmap.hpp"
+
+// One path waiting for its next ray to be marched
+struct PathState {
+    Ray ray;
+    float start = 0;    // Distance along the ray known to be empty
+    Vector weight;      // What light coming back along the ray is worth to the pixel
+    Vector throughput;  // Product of the bounce weights so far, for Russian roulette
+    Sampler sampler;
+    int pixel;          // Index into the radiance buffer
+    int depth;          // Bounce the ray's hit will be
+
+    PathState() : sampler(0) {}
+};
+
+// Direct light that reaches a pixel, scaled by how visible the light is
+// along the ray
+struct ShadowRay {
+    Ray ray;
+    float distance;     // To the light
+    Vector light;       // Added to the pixel when nothing is in the way
+    int pixel;
+};
+
+// Turns a path and the hit its ray marched to into the next bounce's
+// paths and shadow rays
+typedef void(WavefrontShader)(const PathState&, const RayHit&, std::vector<PathState>&, std::vector<ShadowRay>&);
+
+// Breadth-first path tracer. Rather than following one path at a time
+// to the end, all paths are advanced a bounce at a time: every ray in
+// the queue is marched, packets at a time, the hits are sorted by
+// material so each shading branch runs over a contiguous batch, and
+// shading fills the queue for the next bounce along with the shadow
+// rays for this one.
+template<DistanceEstimator *estimator, PacketDistanceEstimator *packetEstimator,
+    GradientEstimator *gradient=FiniteDifferenceGradient<estimator>,
+    PacketGradientEstimator *packetGradient=FiniteDifferenceGradientPacket<packetEstimator>>
+class Wavefront {
+public:
+    // Paths to start from, usually one camera ray per pixel
+    std::vector<PathState> paths;
+    // When set, rays are marched one at a time through the cache
+    const DistanceCache *cache = nullptr;
+    // Passed on to MarchVisibility for the shadow rays
+    float shadowSoftness = 0;
+    // When set, the hits of the starting paths are stored here by pixel
+    RayHit *primaryHits = nullptr;
+    // When set, the marching done for each path and shadow ray is added
+    // here by pixel
+    PixelCost *pixelCosts = nullptr;
+
+    // Traces paths until none are left, adding the light they carry
+    // to radiance[pixel]
+    void run(Vector *radiance, WavefrontShader *shade, float maxDistance=100) {
+        RayHit *firstHits = primaryHits;
+        while (!paths.empty()) {
+            hits.resize(paths.size());
+            march(maxDistance);
+            if (firstHits) {
+                for (size_t i = 0; i < paths.size(); i++) firstHits[paths[i].pixel] = hits[i];
+                firstHits = nullptr;
+            }
+
+            order.resize(paths.size());
+            for (size_t i = 0; i < order.size(); i++) order[i] = i;
+            std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+                return hits[a].material < hits[b].material;
+            });
+
+            next.clear();
+            shadows.clear();
+            for (int i : order) shade(paths[i], hits[i], next, shadows);
+
+            visibility.resize(shadows.size());
+            marchShadows();
+            for (size_t i = 0; i < shadows.size(); i++) {
+                if (visibility[i] > 0) {
+                    radiance[shadows[i].pixel] = radiance[shadows[i].pixel] + shadows[i].light * visibility[i];
+                }
+            }
+
+            paths.swap(next);
+        }
+    }
+
+private:
+    std::vector<RayHit> hits;
+    std::vector<int> order;
+    std::vector<PathState> next;
+    std::vector<ShadowRay> shadows;
+    std::vector<float> visibility;
+
+    // Marches the paths' rays into hits
+    void march(float maxDistance) {
+        if (cache) {
+            for (size_t i = 0; i < paths.size(); i++) {
+                MarchStats before = marchStats;
+                hits[i] = RayMarch(paths[i].ray, estimator, gradient, cache, maxDistance, 99, paths[i].start);
+                if (pixelCosts) pixelCosts[paths[i].pixel].addSince(before);
+            }
+            return;
+        }
+
+        RayPacket packet;
+        RayHit packetHits[PACKET_WIDTH];
+        float starts[PACKET_WIDTH];
+        size_t count = paths.size();
+        for (size_t i = 0; i < count; i += PACKET_WIDTH) {
+            MarchStats before = marchStats;
+            // Lanes past the end repeat the last ray
+            for (int lane = 0; lane < PACKET_WIDTH; lane++) {
+                const PathState &path = paths[i + lane < count ? i + lane : count - 1];
+                packet.set(lane, path.ray);
+                starts[lane] = path.start;
+            }
+            int lanes = std::min<size_t>(PACKET_WIDTH, count - i);
+            RayMarchPacket<estimator, packetEstimator, gradient, packetGradient>(
+                packet, packetHits, maxDistance, 99, PacketFloat::load(starts), lanes);
+            for (int lane = 0; lane < lanes; lane++) hits[i + lane] = packetHits[lane];
+            if (pixelCosts) addPacketCost(before, i, [&](size_t j) { return paths[j].pixel; }, count);
+        }
+    }
+
+    // Finds how visible the light is along each shadow ray
+    void marchShadows() {
+        if (cache) {
+            for (size_t i = 0; i < shadows.size(); i++) {
+                MarchStats before = marchStats;
+                visibility[i] = MarchVisibility(shadows[i].ray, estimator, shadows[i].distance, shadowSoftness, cache);
+                if (pixelCosts) pixelCosts[shadows[i].pixel].addSince(before);
+            }
+            return;
+        }
+
+        RayPacket packet;
+        float distances[PACKET_WIDTH];
+        size_t count = shadows.size();
+        for (size_t i = 0; i < count; i += PACKET_WIDTH) {
+            MarchStats before = marchStats;
+            for (int lane = 0; lane < PACKET_WIDTH; lane++) {
+                const ShadowRay &shadow = shadows[i + lane < count ? i + lane : count - 1];
+                packet.set(lane, shadow.ray);
+                distances[lane] = shadow.distance;
+            }
+            int lanes = std::min<size_t>(PACKET_WIDTH, count - i);
+            PacketFloat v = MarchVisibilityPacket<estimator, packetEstimator>(packet, PacketFloat::load(distances), shadowSoftness, 99, lanes);
+            for (int lane = 0; lane < lanes; lane++) visibility[i + lane] = v[lane];
+            if (pixelCosts) addPacketCost(before, i, [&](size_t j) { return shadows[j].pixel; }, count);
+        }
+    }
+
+    // Splits the marching since before evenly between the pixels of the
+    // packet starting at queue index first
+    template<class F>
+    void addPacketCost(const MarchStats &before, size_t first, F pixel, size_t count) {
+        int lanes = std::min<size_t>(PACKET_WIDTH, count - first);
+        for (int lane = 0; lane < lanes; lane++) pixelCosts[pixel(first + lane)].addSince(before, 1.f / lanes);
+    }
+};
+
+#endif // _WAVEFRONT_H
@@ -0,0 +1,121 @@
+// Microbenchmarks for the raymarcher's building blocks. Each one times an
+// operation over a fixed number of iterations on fixed inputs and
+// appends the result to benchmark.json, next to the full renders. Build
+// it on its own, with the same flags as main.cpp:
+//   g++ -O2 benchmark.cpp -o benchmark
+// The scene benchmarks run main.cpp's estimators from Scene.hpp, on the
+// scene main.cpp renders by default. Add -DSCENE=SCENE_BVH or
+// -DSCENE=SCENE_CSG to time another one.
+
+#include <stdio.h>
+#include <stdint.h>
+#include "Vector.hpp"
+#include "Ray.hpp"
+#include "RayPacket.hpp"
+#include "Scene.hpp"
+#include "Sampler.hpp"
+#include "Bsdf.hpp"
+#include "../Benchmark.hpp"
+
+#define INPUTS 1024 // Power of 2
+#define ITERATIONS 4000000
+
+Vector points[INPUTS];
+Vector directions[INPUTS];
+Ray rays[INPUTS];
+PointPacket pointPackets[INPUTS];
+
+// Results are summed in here so the compiler can't drop the work
+volatile float sink;
+
+template<class F>
+void Run(const char *name, uint64_t iterations, F op) {
+    float sum = 0;
+    uint64_t start = BenchmarkMicros();
+    for (uint64_t i = 0; i < iterations; i++) sum += op(i & (INPUTS - 1));
+    double seconds = (BenchmarkMicros() - start) / 1e6;
+    sink = sum;
+    printf("%-20s %10.2f ns\n", name, seconds * 1e9 / iterations);
+    WriteMicroBenchmark(name, iterations, seconds);
+}
+
+int main() {
+    if (SCENE == SCENE_BVH) BuildBvhScene();
+
+    // Points above the floor among the spheres, and rays looking down at
+    // them from the default camera position
+    Sampler sampler(0, 1);
+    for (int i = 0; i < INPUTS; i++) {
+        points[i] = Vector(sampler.next() * 40 - 20, sampler.next() * 4, sampler.next() * 40 - 20);
+        directions[i] = !Vector(sampler.next() * 2 - 1, sampler.next() * 2 - 1, sampler.next() * 2 - 1);
+        rays[i] = { Vector(-3, 5, 5), !(points[i] - Vector(-3, 5, 5)) };
+    }
+    for (int i = 0; i < INPUTS; i++) {
+        for (int lane = 0; lane < PACKET_WIDTH; lane++) pointPackets[i].set(lane, points[(i + lane) & (INPUTS - 1)]);
+    }
+
+    Run("vector_add", ITERATIONS * 10, [](int i) {
+        return (points[i] + directions[i]).x;
+    });
+    Run("vector_dot", ITERATIONS * 10, [](int i) {
+        return points[i] % directions[i];
+    });
+    Run("vector_cross", ITERATIONS * 10, [](int i) {
+        return points[i].cross(directions[i]).y;
+    });
+    Run("vector_normalize", ITERATIONS * 10, [](int i) {
+        return (!points[i]).z;
+    });
+
+    Run("get_distance", ITERATIONS, [](int i) {
+        int material;
+        return GetDistance(points[i], material);
+    });
+    Run("get_distance_packet", ITERATIONS / PACKET_WIDTH, [](int i) {
+        PacketFloat d, material;
+        GetDistancePacket(pointPackets[i], d, material);
+        return d[0];
+    });
+    Run("get_gradient", ITERATIONS, [](int i) {
+        Vector g;
+        GetGradient(points[i], g);
+        return g.x;
+    });
+
+    Run("ray_march", ITERATIONS / 20, [](int i) {
+        return RayMarch(rays[i], &GetDistance, &GetGradient).traveled;
+    });
+    Run("ray_march_packet", ITERATIONS / 20 / PACKET_WIDTH, [](int i) {
+        RayPacket packet;
+        for (int lane = 0; lane < PACKET_WIDTH; lane++) packet.set(lane, rays[(i + lane) & (INPUTS - 1)]);
+        RayHit hits[PACKET_WIDTH];
+        RayMarchPacket<GetDistance, GetDistancePacket, GetGradient, GetGradientPacket>(packet, hits);
+        return hits[0].traveled;
+    });
+    Run("march_visibility", ITERATIONS / 20, [](int i) {
+        Ray up = { points[i], Vector(0, 1, 0) };
+        return MarchVisibility(up, &GetDistance, 10);
+    });
+
+    Run("sampler_next", ITERATIONS, [](int i) {
+        Sampler s(i);
+        return s.next();
+    });
+    Run("sampler_next_sobol", ITERATIONS, [](int i) {
+        Sampler s(i, 0, SEQUENCE_SOBOL);
+        return s.next();
+    });
+    // Takes the place of the old GetReflectionRay
+    Run("ggx_sample", ITERATIONS, [](int i) {
+        Ggx ggx{Vector(1, 0.6, 0.9), 0.05};
+        Frame frame(Vector(0, 1, 0));
+        Vector wo = directions[i];
+        wo.y = fabsf(wo.y);
+        return ggx.sample(frame, wo, points[i].y * 0.25f, (directions[i].x + 1) * 0.5f).weight.x;
+    });
+    Run("lambert_sample", ITERATIONS, [](int i) {
+        Lambert lambert{Vector(0.5)};
+        Frame frame(directions[i]);
+        return lambert.sample(frame, Vector(0, 1, 0), points[i].y * 0.25f, (directions[i].x + 1) * 0.5f).direction.x;
+    });
+}
@@ -0,0 +1,45 @@
+// Checks of the raymarcher's gradients that are easy to break without
+// it showing in a render. Prints every failed check and returns the
+// number of failures. Build it on its own, with the same flags as
+// main.cpp:
+//   g++ -O2 check.cpp -o check
+
+#include <stdio.h>
+#include <math.h>
+#include "Vector.hpp"
+#include "RayPacket.hpp"
+#include "Csg.hpp"
+#include "Bvh.hpp"
+
+int failures = 0;
+
+void Check(bool ok, const char *what, Vector v) {
+    if (ok) return;
+    printf("FAILED %s: (%g, %g, %g)\n", what, v.x, v.y, v.z);
+    failures++;
+}
+
+bool Finite(Vector v) {
+    return isfinite(v.x) && isfinite(v.y) && isfinite(v.z);
+}
+
+int main() {
+    // Inside a box the part of its distance outside of it is 0, and the
+    // square root of that used to give NaN normals
+    Vector inside(0.2, 0.9995, 0.1);
+    Vector gradient;
+    CsgGradient<Box<1000, 1000, 1000>>(inside, gradient);
+    Check(Finite(gradient) && fabsf(gradient.y - 1) < 1e-4f, "CSG box gradient inside", gradient);
+    PointPacket packetGradient;
+    CsgGradientPacket<Box<1000, 1000, 1000>>(PointPacket(inside), packetGradient);
+    Check(Finite(packetGradient[0]) && fabsf(packetGradient.y[0] - 1) < 1e-4f, "CSG box packet gradient inside", packetGradient[0]);
+
+    BvhScene box;
+    box.add({ PRIMITIVE_BOX, Vector(0), Vector(1), 1 });
+    box.build();
+    gradient = box.gradient(inside);
+    Check(Finite(gradient) && fabsf(gradient.y - 1) < 1e-4f, "BVH box gradient inside", gradient);
+
+    printf("%d checks failed.\n", failures);
+    return failures;
+}
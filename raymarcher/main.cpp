@@ -3,172 +3,710 @@
 
 #include <stdio.h>
 #include <stdlib.h>
-#include <random>
-#include <mutex>
+#include <string.h>
 #include <thread>
 #include <chrono>
 #include <vector>
+#include <mutex>
 
 #include "Vector.hpp"
 #include "Ray.hpp"
+#include "RayPacket.hpp"
 #include "Camera.hpp"
+#include "Scheduler.hpp"
+#include "Sampler.hpp"
+#include "PixelStats.hpp"
+#include "Framebuffer.hpp"
+#include "Wavefront.hpp"
+#include "Bsdf.hpp"
+#include "Denoiser.hpp"
+#include "Heatmap.hpp"
 #include "util.hpp"
 #include "stopwatch.hpp"
+#include "../Image.hpp"
+#include "../Benchmark.hpp"
+#include "../Convergence.hpp"
+#include "../Checkpoint.hpp"
 
 #define WIDTH 1920
 #define HEIGHT 1080
 #define TILE_WIDTH 32
 #define TILE_HEIGHT TILE_WIDTH
+#define TILES_X ((WIDTH + TILE_WIDTH - 1) / TILE_WIDTH)
+#define TILES_Y ((HEIGHT + TILE_HEIGHT - 1) / TILE_HEIGHT)
+#define TILE_ORDER TILE_ORDER_ROWS
 #define FOV 90
 #define BOUNCES 4
+// Bounce from which Russian roulette may end dim paths early, at least 1
+#define RR_MIN_DEPTH 1
+// 0 for hard shadows. Otherwise shadow rays that pass close to a surface
+// darken into a penumbra, which gets wider as this gets smaller.
+#define SHADOW_SOFTNESS 0
 #define SAMPLES 64
-
+#define SEED 0
+// SEQUENCE_SOBOL or SEQUENCE_RANDOM, for the numbers paths are sampled with
+#define SAMPLE_SEQUENCE SEQUENCE_SOBOL
+// March primary rays PACKET_WIDTH pixels at a time
+#define PACKET_MARCH 1
+// Before the pixels of a tile are marched, march one cone around each
+// CONE_BLOCK x CONE_BLOCK block of their rays, and start the rays where
+// it first comes close to a surface
+#define CONE_MARCH 1
+#define CONE_BLOCK 8
+#define CONE_BLOCKS_X ((TILE_WIDTH + CONE_BLOCK - 1) / CONE_BLOCK)
+#define CONE_BLOCKS_Y ((TILE_HEIGHT + CONE_BLOCK - 1) / CONE_BLOCK)
+// Trace each tile's paths a bounce at a time with the Wavefront engine
+// instead of one after another. Ignored when ADAPTIVE is on.
+#define WAVEFRONT 0
+
+// SCENE_FIELD, SCENE_BVH or SCENE_CSG, the built-in scenes in Scene.hpp
+#define SCENE SCENE_FIELD
+#define BVH_FIELD_SIZE 32
+
+// Bake the scene's distances over DISTANCE_CACHE_MIN to DISTANCE_CACHE_MAX
+// into a DistanceCache, with bricks DISTANCE_CACHE_BRICK units across and
+// DISTANCE_CACHE_RESOLUTION samples along each side of the fine ones, and
+// march through empty space with it. The cache is saved to
+// DISTANCE_CACHE_FILE and loaded from there by later renders of the same
+// scene; delete the file after editing a built-in scene. Primary rays are
+// marched one at a time while it is on.
+#define DISTANCE_CACHE 0
+#define DISTANCE_CACHE_MIN Vector(-40, -1, -40)
+#define DISTANCE_CACHE_MAX Vector(40, 12, 40)
+#define DISTANCE_CACHE_BRICK 1
+#define DISTANCE_CACHE_RESOLUTION 4
+#define DISTANCE_CACHE_FILE "distance.cache"
+
+// Adaptive sampling replaces the fixed SAMPLES per pixel. The first pass
+// gives every pixel ADAPTIVE_MIN_SAMPLES paths, and each later pass adds
+// ADAPTIVE_BATCH paths to the pixels whose estimated error is still above
+// ADAPTIVE_ERROR, until they reach ADAPTIVE_MAX_SAMPLES. The error is a
+// standard error in tone-mapped units, where 1 is full white.
+#define ADAPTIVE 0
+#define ADAPTIVE_MIN_SAMPLES 16
+#define ADAPTIVE_BATCH 16
+#define ADAPTIVE_MAX_SAMPLES 256
+#define ADAPTIVE_ERROR 0.01
+
+// Run the finished image through the edge-aware filter in Denoiser.hpp
+// before it is written, for clean images from few samples
+#define DENOISE 0
+#define DENOISE_ITERATIONS 5
+// Also write the first hit's albedo, normal and depth as float images
+#define WRITE_FEATURES 0
+#define ALBEDO_FILENAME "albedo.pfm"
+#define NORMAL_FILENAME "normal.pfm"
+#define DEPTH_FILENAME "depth.pfm"
+
+// Record the rays, march steps and distance evaluations spent on every
+// pixel and the time spent on every tile. They are written as heatmaps
+// named HEATMAP_PREFIX followed by what they show, and the
+// HEATMAP_WORST_TILES slowest tiles are listed.
+#define HEATMAP 0
+#define HEATMAP_PREFIX "heat_"
+#define HEATMAP_WORST_TILES 10
+
+// Run the equal-time convergence test in Convergence.hpp instead of a
+// single render. The reference gets CONVERGENCE_REFERENCE_SAMPLES paths
+// per pixel, traced with SEED + 1. Then the image is rendered in passes
+// for CONVERGENCE_SECONDS, each adding CONVERGENCE_BATCH paths per pixel,
+// or making one adaptive pass when ADAPTIVE is on. Paths are traced one
+// pixel at a time even when WAVEFRONT is on.
+#define CONVERGENCE 0
+#define CONVERGENCE_REFERENCE_SAMPLES 1024
+#define CONVERGENCE_BATCH 4
+#define CONVERGENCE_SECONDS 60
+
+// Save the render's progress to CHECKPOINT_FILE every CHECKPOINT_SECONDS,
+// in between tiles. A render that finds a checkpoint with the same
+// settings goes on from there, and deletes it once the image is written.
+#define CHECKPOINT 0
+#define CHECKPOINT_FILE "render.checkpoint"
+#define CHECKPOINT_SECONDS 60
+
+// Sharded renders (--tiles or --samples on the command line) write their
+// part of the framebuffer here unless given an output file, %d being
+// the shard's index. merge.cpp combines the parts into the image.
+#define SHARD_FILENAME "shard_%d.fb"
+
+// .ppm or .png, or .pfm or .exr for the radiance before tone mapping
 #define FILENAME "image.ppm"
 
 #define PI 3.141592653
 #define TWO_PI 6.283185307
 #define ROOT2 1.41421356237
 
-constexpr int TILE_H_COUNT = HEIGHT / TILE_HEIGHT + 1;
-constexpr int TILE_W_COUNT = WIDTH / TILE_WIDTH + 1;
+#include "Scene.hpp"
 
 Vector cameraPos(-3, 5, 5);
 float azimuth = -PI / 4;
 float cameraZRot = -PI / 6;
 
-// Global random engine
-std::default_random_engine generator;
-
-Vector Trace(Ray ray, int samples, int depth=0);
-Vector IncomingLuminance(RayHit surface, int samples, int depth);
+Vector TracePath(Ray ray, Sampler sampler, int depth);
+Vector Shade(RayHit surface, int samples, Sampler sampler, int depth);
+Vector IncomingLuminance(RayHit surface, int samples, Sampler sampler, int depth);
+void ShadeWavefront(const PathState &path, const RayHit &surface, std::vector<PathState> &next, std::vector<ShadowRay> &shadows);
 Vector IncomingLight(RayHit hit, Vector &lightDir);
-float GetDistance(Vector position, int &hitType);
 
 Vector CheckerColor(Vector pos);
+Vector SurfaceAlbedo(RayHit surface);
 
 Camera camera(WIDTH, HEIGHT, FOV);
-int pixels[WIDTH * HEIGHT * 3];
-int doneThreads;
+// Paths add their radiance to here, and it is only tone mapped into
+// pixels when the image is written
+Framebuffer framebuffer(WIDTH, HEIGHT);
+unsigned char pixels[WIDTH * HEIGHT * 3];
+// The first hit's features the denoiser tells edges apart with. Normals
+// are 0 where the ray missed.
+Vector albedoBuffer[WIDTH * HEIGHT];
+Vector normalBuffer[WIDTH * HEIGHT];
+float depthBuffer[WIDTH * HEIGHT];
+// Filled in when HEATMAP is on
+PixelCost pixelCosts[WIDTH * HEIGHT];
+TileCost tileCosts[TILES_X * TILES_Y];
+PixelStats stats[WIDTH * HEIGHT];
+MarchStats totalMarchStats;
+std::mutex marchStatsMutex;
+DistanceCache distanceCache;
+// Points to distanceCache when DISTANCE_CACHE is on
+const DistanceCache *marchCache = nullptr;
+// The convergence test renders its reference with another seed, and
+// with the same number of paths in every pixel even when ADAPTIVE is on
+uint32_t renderSeed = SEED;
+bool renderingReference = false;
+// Tiles finished in the current pass, by TileScheduler::index
+std::vector<char> tileDone(TILES_X * TILES_Y);
+// Set for the main render when CHECKPOINT is on
+bool checkpointing = false;
+stopwatch checkpointTime;
+char checkpointFile[256] = CHECKPOINT_FILE;
+// Set by --tiles index/count, which renders every count-th tile, and
+// --samples index/count, which renders that share of every pixel's paths
+int shardIndex = 0, shardCount = 1;
+bool sampleShards = false;
+// Tiles another shard renders, by TileScheduler::index
+std::vector<char> tileOutside(TILES_X * TILES_Y);
+int sampleFirst = 0, sampleEnd = SAMPLES;
+
+void SetupDistanceCache(int threads) {
+    // Scene files are told apart by their text, built-in scenes by number
+    uint64_t key = useSceneFile ? sceneFile.hash : (uint64_t)SCENE << 32 | BVH_FIELD_SIZE;
+    if (distanceCache.load(DISTANCE_CACHE_FILE, key, DISTANCE_CACHE_MIN, DISTANCE_CACHE_MAX, DISTANCE_CACHE_BRICK, DISTANCE_CACHE_RESOLUTION)) {
+        printf("Loaded distance cache from %s.\n", DISTANCE_CACHE_FILE);
+    } else {
+        stopwatch bakeTime;
+        distanceCache.key = key;
+        distanceCache.bake(&GetDistance, DISTANCE_CACHE_MIN, DISTANCE_CACHE_MAX, DISTANCE_CACHE_BRICK, DISTANCE_CACHE_RESOLUTION, threads);
+        printf("Baked distance cache in %f seconds.\n", bakeTime.elapsed_millis() / 1000.);
+        if (!distanceCache.save(DISTANCE_CACHE_FILE)) printf("Failed to write %s.\n", DISTANCE_CACHE_FILE);
+    }
+    printf("%d bricks, %d fine, %d exact, %f MB.\n", distanceCache.brickCount(), distanceCache.fineBrickCount(),
+        distanceCache.exactBrickCount(), distanceCache.bytes() / 1e6);
+    marchCache = &distanceCache;
+}
+
+// Whether a pixel takes part in the given pass
+bool NeedsSamples(int x, int y, int pass) {
+    if (pass == 0) return true;
+    if (!ADAPTIVE) return CONVERGENCE;
+    const PixelStats &s = stats[x + y * WIDTH];
+    // Error as it shows up after tone mapping, using the slope of
+    // L / (1 + L) at the current mean
+    float slope = 1 / ((1 + s.luminanceMean) * (1 + s.luminanceMean));
+    return s.count < ADAPTIVE_MAX_SAMPLES && s.standardError() * slope > ADAPTIVE_ERROR;
+}
+
+void SetFeatures(int x, int y, RayHit hit) {
+    int i = y * WIDTH + x;
+    albedoBuffer[i] = SurfaceAlbedo(hit);
+    normalBuffer[i] = hit.material == 0 ? Vector(0) : hit.normal;
+    depthBuffer[i] = hit.traveled;
+}
+
+void RenderPixel(int x, int y, RayHit hit, int pass) {
+    if (pass == 0) SetFeatures(x, y, hit);
+    Sampler sampler(x + y * WIDTH, renderSeed, SAMPLE_SEQUENCE);
+    if (!ADAPTIVE && !CONVERGENCE && !sampleShards) {
+        framebuffer.add(x + y * WIDTH, Shade(hit, SAMPLES, sampler, 0), SAMPLES);
+        return;
+    }
+    if (sampleShards) {
+        // The same paths Shade gives the whole pixel, one at a time
+        for (int n = sampleFirst; n < sampleEnd; n++) framebuffer.add(x + y * WIDTH, Shade(hit, 1, sampler.split(n, SAMPLES), 0));
+        return;
+    }
+
+    // Path n of the pixel always uses the same random stream, so the
+    // result does not depend on how the samples were split into passes
+    PixelStats &s = stats[x + y * WIDTH];
+    int target;
+    if (renderingReference) {
+        target = CONVERGENCE_REFERENCE_SAMPLES;
+    } else if (ADAPTIVE) {
+        target = pass == 0 ? ADAPTIVE_MIN_SAMPLES : s.count + ADAPTIVE_BATCH;
+        if (target > ADAPTIVE_MAX_SAMPLES) target = ADAPTIVE_MAX_SAMPLES;
+    } else {
+        target = s.count + CONVERGENCE_BATCH;
+    }
+    while (s.count < target) {
+        Vector radiance = Shade(hit, 1, sampler.split(s.count, ADAPTIVE_MAX_SAMPLES), 0);
+        s.add(radiance);
+        framebuffer.add(x + y * WIDTH, radiance);
+    }
+}
+
+// Distance every primary ray from pixels x0 to x1 and y0 to y1 can skip
+float ConeDepth(int x0, int y0, int x1, int y1) {
+    if (!CONE_MARCH) return 0;
+    Vector corners[4] = {
+        camera.getCameraRay(x0, y0).direction,
+        camera.getCameraRay(x1, y0).direction,
+        camera.getCameraRay(x0, y1).direction,
+        camera.getCameraRay(x1, y1).direction
+    };
+    // A cone holding the rays of the corner pixels holds every ray between
+    Vector axis = !(corners[0] + corners[1] + corners[2] + corners[3]);
+    float cosHalfAngle = 1;
+    for (Vector &c : corners) cosHalfAngle = fminf(cosHalfAngle, axis % c);
+    float tanHalfAngle = sqrtf(1 - cosHalfAngle * cosHalfAngle) / cosHalfAngle;
+    return ConeMarch(camera.position, axis, tanHalfAngle, &GetDistance);
+}
 
 // The struct that is in charge of each thread
 struct Task {
-    Task() : my_id{id++} {}
-    Task(int x, int y) : sx{x}, sy{y}, my_id{id++} {}
-
-    bool get_next_task() {
-        static bool taken[TILE_H_COUNT][TILE_W_COUNT] = {};
-        static std::mutex m;
-
-        std::lock_guard<std::mutex> guard{m};
-
-        bool found = false;
-        int x = 0;
-        int y = 0;
-        while (!found) {
-            if (!taken[y][x]) {
-                sx = x * TILE_WIDTH;
-                sy = y * TILE_HEIGHT;
-                taken[y][x] = true;
-                found = true;
-            } else {
-                x++;
-                if (x >= TILE_W_COUNT) { x = 0; y++; }
-                if (y >= TILE_H_COUNT) break;
-            }
-        }
-        return found;
-    }
+    Task(TileScheduler *scheduler, int id, int pass) : scheduler{scheduler}, my_id{id}, pass{pass} {}
 
     void operator()() {
-        bool done = false;
         int tasksCompleted = 0;
-        do {
-            if (!get_next_task()) {
-                done = true;
+        Tile tile;
+        while (scheduler->next(my_id, tile)) {
+            unsigned sx = tile.x;
+            unsigned sy = tile.y;
+            stopwatch tileTime;
+            MarchStats tileStart = marchStats;
+            float coneDepth[CONE_BLOCKS_Y][CONE_BLOCKS_X];
+            for (int by = 0; by < CONE_BLOCKS_Y; by++) {
+                for (int bx = 0; bx < CONE_BLOCKS_X; bx++) {
+                    int x0 = sx + bx * CONE_BLOCK, y0 = sy + by * CONE_BLOCK;
+                    if (x0 >= WIDTH || y0 >= HEIGHT) continue;
+                    int x1 = x0 + CONE_BLOCK - 1 < WIDTH ? x0 + CONE_BLOCK - 1 : WIDTH - 1;
+                    int y1 = y0 + CONE_BLOCK - 1 < HEIGHT ? y0 + CONE_BLOCK - 1 : HEIGHT - 1;
+                    coneDepth[by][bx] = ConeDepth(x0, y0, x1, y1);
+                }
+            }
+            if (WAVEFRONT && !ADAPTIVE && !CONVERGENCE && !sampleShards) {
+                renderWavefront(sx, sy, coneDepth);
+                if (HEATMAP) recordTile(sx, sy, tileStart, tileTime);
+                finishTile(tile);
+                tasksCompleted++;
                 continue;
             }
-
             for (unsigned y = sy; y < sy + TILE_HEIGHT; y++) {
-                for (unsigned x = sx; x < sx + TILE_WIDTH; x++) {
-                    if (x >= WIDTH || y >= HEIGHT) continue;
-                    Vector luminance = Trace(camera.getCameraRay(x, y), SAMPLES);
-                    luminance = luminance + (5. / 241.);
-                    luminance = luminance / (1. + luminance);
-                    Vector color = luminance * 255;
-                    int r = color.x > 255 ? 255 : (int)color.x;
-                    int g = color.y > 255 ? 255 : (int)color.y;
-                    int b = color.z > 255 ? 255 : (int)color.z;
-                    int i = (y * WIDTH + x) * 3;
-                    pixels[i] = r;
-                    pixels[i+1] = g;
-                    pixels[i+2] = b;
+                if (y >= HEIGHT) continue;
+                if (PACKET_MARCH && !marchCache) {
+                    for (unsigned x = sx; x < sx + TILE_WIDTH; x += PACKET_WIDTH) {
+                        bool needed = false;
+                        for (int i = 0; i < PACKET_WIDTH && x + i < WIDTH; i++) {
+                            needed = needed || NeedsSamples(x + i, y, pass);
+                        }
+                        if (!needed) continue;
+
+                        MarchStats before = marchStats;
+                        RayPacket packet;
+                        RayHit hits[PACKET_WIDTH];
+                        float start[PACKET_WIDTH];
+                        // Lanes past the right edge repeat the last pixel
+                        for (int i = 0; i < PACKET_WIDTH; i++) {
+                            unsigned px = x + i < WIDTH ? x + i : WIDTH - 1;
+                            packet.set(i, camera.getCameraRay(px, y));
+                            start[i] = coneDepth[(y - sy) / CONE_BLOCK][(px - sx) / CONE_BLOCK];
+                        }
+                        int lanes = WIDTH - x < PACKET_WIDTH ? WIDTH - x : PACKET_WIDTH;
+                        RayMarchPacket<GetDistance, GetDistancePacket, GetGradient, GetGradientPacket>(packet, hits, 100, 99, PacketFloat::load(start), lanes);
+                        if (HEATMAP) {
+                            for (int i = 0; i < lanes; i++) pixelCosts[x + i + y * WIDTH].addSince(before, 1.f / lanes);
+                        }
+                        for (int i = 0; i < lanes; i++) {
+                            if (!NeedsSamples(x + i, y, pass)) continue;
+                            before = marchStats;
+                            RenderPixel(x + i, y, hits[i], pass);
+                            if (HEATMAP) pixelCosts[x + i + y * WIDTH].addSince(before);
+                        }
+                    }
+                } else {
+                    for (unsigned x = sx; x < sx + TILE_WIDTH; x++) {
+                        if (x >= WIDTH || !NeedsSamples(x, y, pass)) continue;
+                        float start = coneDepth[(y - sy) / CONE_BLOCK][(x - sx) / CONE_BLOCK];
+                        MarchStats before = marchStats;
+                        RenderPixel(x, y, RayMarch(camera.getCameraRay(x, y), &GetDistance, &GetGradient, marchCache, 100, 99, start), pass);
+                        if (HEATMAP) pixelCosts[x + y * WIDTH].addSince(before);
+                    }
                 }
             }
+            if (HEATMAP) recordTile(sx, sy, tileStart, tileTime);
+            finishTile(tile);
             tasksCompleted++;
-        } while (!done);
+        }
+
+        if (!ADAPTIVE && !CONVERGENCE) printf("Thread %d finished and rendered %d tiles.\n", my_id, tasksCompleted);
+
+        std::lock_guard<std::mutex> lock(marchStatsMutex);
+        totalMarchStats.rays += marchStats.rays;
+        totalMarchStats.steps += marchStats.steps;
+        totalMarchStats.capped += marchStats.capped;
+        totalMarchStats.cones += marchStats.cones;
+        totalMarchStats.coneSteps += marchStats.coneSteps;
+        totalMarchStats.evaluations += marchStats.evaluations;
+        marchStats = MarchStats();
+    }
+
+    void renderWavefront(unsigned sx, unsigned sy, float coneDepth[CONE_BLOCKS_Y][CONE_BLOCKS_X]) {
+        Vector radiance[TILE_WIDTH * TILE_HEIGHT];
+        RayHit primary[TILE_WIDTH * TILE_HEIGHT];
+        PixelCost costs[TILE_WIDTH * TILE_HEIGHT];
+        wavefront.primaryHits = primary;
+        wavefront.pixelCosts = HEATMAP ? costs : nullptr;
+        wavefront.cache = marchCache;
+        wavefront.shadowSoftness = SHADOW_SOFTNESS;
+        wavefront.paths.clear();
+        for (unsigned y = sy; y < sy + TILE_HEIGHT && y < HEIGHT; y++) {
+            for (unsigned x = sx; x < sx + TILE_WIDTH && x < WIDTH; x++) {
+                PathState path;
+                path.ray = camera.getCameraRay(x, y);
+                path.start = coneDepth[(y - sy) / CONE_BLOCK][(x - sx) / CONE_BLOCK];
+                path.weight = Vector(1);
+                path.sampler = Sampler(x + y * WIDTH, renderSeed, SAMPLE_SEQUENCE);
+                path.pixel = (y - sy) * TILE_WIDTH + (x - sx);
+                path.depth = 0;
+                wavefront.paths.push_back(path);
+                radiance[path.pixel] = Vector(0);
+            }
+        }
+        wavefront.run(radiance, ShadeWavefront);
+        for (unsigned y = sy; y < sy + TILE_HEIGHT && y < HEIGHT; y++) {
+            for (unsigned x = sx; x < sx + TILE_WIDTH && x < WIDTH; x++) {
+                SetFeatures(x, y, primary[(y - sy) * TILE_WIDTH + (x - sx)]);
+                if (HEATMAP) pixelCosts[x + y * WIDTH].add(costs[(y - sy) * TILE_WIDTH + (x - sx)]);
+                framebuffer.add(x + y * WIDTH, radiance[(y - sy) * TILE_WIDTH + (x - sx)], SAMPLES);
+            }
+        }
+    }
 
-        printf("Thread %d finished and rendered %d tiles.\n", my_id, tasksCompleted);
-        doneThreads++;
+    // Stops the pass once a checkpoint is due, so it can be saved
+    void finishTile(const Tile &tile) {
+        tileDone[scheduler->index(tile)] = 1;
+        if (checkpointing && checkpointTime.elapsed_millis() >= CHECKPOINT_SECONDS * 1000) scheduler->stop();
     }
 
-    int sx = -1, sy = -1;
+    void recordTile(unsigned sx, unsigned sy, const MarchStats &start, stopwatch &time) {
+        TileCost &cost = tileCosts[sy / TILE_HEIGHT * TILES_X + sx / TILE_WIDTH];
+        cost.x = sx;
+        cost.y = sy;
+        cost.addSince(start, time.elapsed_micros() / 1e6);
+    }
+
+    TileScheduler *scheduler;
     int my_id;
-    static int id;
+    int pass;
+    Wavefront<GetDistance, GetDistancePacket, GetGradient, GetGradientPacket> wavefront;
 };
 
-int Task::id = 0;
+void WriteFeatures() {
+    std::vector<float> depth(WIDTH * HEIGHT * 3);
+    for (int i = 0; i < WIDTH * HEIGHT; i++) depth[i * 3] = depth[i * 3 + 1] = depth[i * 3 + 2] = depthBuffer[i];
+    if (!WriteImage(ALBEDO_FILENAME, &albedoBuffer[0].x, WIDTH, HEIGHT)) printf("Failed to write %s.\n", ALBEDO_FILENAME);
+    if (!WriteImage(NORMAL_FILENAME, &normalBuffer[0].x, WIDTH, HEIGHT)) printf("Failed to write %s.\n", NORMAL_FILENAME);
+    if (!WriteImage(DEPTH_FILENAME, depth.data(), WIDTH, HEIGHT)) printf("Failed to write %s.\n", DEPTH_FILENAME);
+}
 
-int main() {
-    FILE* fp;
-    if (fopen_s(&fp, FILENAME, "wb") != 0) {
-        fprintf(fp, "Failed to open file.");
-        return -1;
+void WriteHeatmaps() {
+    std::vector<float> values(WIDTH * HEIGHT);
+    for (int i = 0; i < WIDTH * HEIGHT; i++) values[i] = pixelCosts[i].rays;
+    printf("Rays heatmap tops out at %f per pixel.\n", WriteHeatmap(HEATMAP_PREFIX "rays.png", values.data(), WIDTH, HEIGHT));
+    for (int i = 0; i < WIDTH * HEIGHT; i++) values[i] = pixelCosts[i].steps;
+    printf("Steps heatmap tops out at %f per pixel.\n", WriteHeatmap(HEATMAP_PREFIX "steps.png", values.data(), WIDTH, HEIGHT));
+    for (int i = 0; i < WIDTH * HEIGHT; i++) values[i] = pixelCosts[i].evaluations;
+    printf("Evaluations heatmap tops out at %f per pixel.\n", WriteHeatmap(HEATMAP_PREFIX "evaluations.png", values.data(), WIDTH, HEIGHT));
+    for (int y = 0; y < HEIGHT; y++) {
+        for (int x = 0; x < WIDTH; x++) values[x + y * WIDTH] = tileCosts[y / TILE_HEIGHT * TILES_X + x / TILE_WIDTH].seconds;
+    }
+    printf("Time heatmap tops out at %f ms per tile.\n", 1000 * WriteHeatmap(HEATMAP_PREFIX "time.png", values.data(), WIDTH, HEIGHT));
+    PrintWorstTiles(tileCosts, TILES_X * TILES_Y, HEATMAP_WORST_TILES);
+}
+
+// Settings the saved state depends on
+uint64_t RenderKey() {
+    uint64_t scene = useSceneFile ? sceneFile.hash : (uint64_t)SCENE << 32 | BVH_FIELD_SIZE;
+    return CheckpointKey({ scene, WIDTH, HEIGHT, TILE_WIDTH, TILE_HEIGHT, SAMPLES, SEED, SAMPLE_SEQUENCE, BOUNCES,
+        RR_MIN_DEPTH, ADAPTIVE, ADAPTIVE_MIN_SAMPLES, ADAPTIVE_BATCH, ADAPTIVE_MAX_SAMPLES, DENOISE || WRITE_FEATURES,
+        DISTANCE_CACHE, CONE_MARCH, CONE_BLOCK, CheckpointBits(MARCH_RELAXATION), CheckpointBits(SHADOW_SOFTNESS),
+        CheckpointBits(ADAPTIVE_ERROR), CheckpointBits(camera.fov), CheckpointBits(cameraPos.x), CheckpointBits(cameraPos.y), CheckpointBits(cameraPos.z),
+        CheckpointBits(azimuth), CheckpointBits(cameraZRot) });
+}
+
+// Shards of one render share its key, but not their checkpoints
+uint64_t ShardCheckpointKey() {
+    return CheckpointKey({ RenderKey(), (uint64_t)shardIndex, (uint64_t)shardCount, sampleShards });
+}
+
+// Everything a resumed render needs: the pass, its finished tiles and
+// the pixels so far. Pixel statistics and first-hit features only when
+// something uses them.
+std::vector<CheckpointSection> CheckpointState(int &pass) {
+    std::vector<CheckpointSection> state = {
+        { &pass, sizeof(pass) },
+        { tileDone.data(), tileDone.size() },
+        { framebuffer.sums.data(), framebuffer.sums.size() * sizeof(float) },
+        { framebuffer.counts.data(), framebuffer.counts.size() * sizeof(int) }
+    };
+    if (ADAPTIVE) state.push_back({ stats, sizeof(stats) });
+    if (DENOISE || WRITE_FEATURES) {
+        state.push_back({ albedoBuffer, sizeof(albedoBuffer) });
+        state.push_back({ normalBuffer, sizeof(normalBuffer) });
+        state.push_back({ depthBuffer, sizeof(depthBuffer) });
+    }
+    return state;
+}
+
+void SaveCheckpoint(int pass) {
+    stopwatch saveTime;
+    if (WriteCheckpoint(checkpointFile, ShardCheckpointKey(), CheckpointState(pass))) {
+        printf("Saved checkpoint in pass %d with %d of %d tiles done, in %f seconds.\n", pass,
+            (int)std::count(tileDone.begin(), tileDone.end(), 1), (int)tileDone.size(), saveTime.elapsed_millis() / 1000.);
+    } else {
+        printf("Failed to write %s.\n", checkpointFile);
+    }
+    checkpointTime = stopwatch();
+}
+
+// Renders the tiles of a pass that aren't done yet. When a checkpoint is
+// due the workers stop after their current tile, the progress is saved
+// and they start again on the rest.
+void RunPass(TileScheduler &scheduler, std::vector<std::thread> &threads, int pass) {
+    for (;;) {
+        scheduler.reset(&tileDone);
+        for (unsigned int i = 0; i < threads.size(); i++) threads[i] = std::thread{Task{&scheduler, (int)i, pass}};
+        for (auto &t: threads) t.join();
+        if (std::count(tileDone.begin(), tileDone.end(), 1) == (int)tileDone.size()) break;
+        SaveCheckpoint(pass);
+    }
+    tileDone = tileOutside;
+}
+
+int RemainingPixels(int pass) {
+    int remaining = 0;
+    for (int y = 0; y < HEIGHT; y++) {
+        for (int x = 0; x < WIDTH; x++) {
+            if (!tileOutside[y / TILE_HEIGHT * TILES_X + x / TILE_WIDTH]) remaining += NeedsSamples(x, y, pass);
+        }
+    }
+    return remaining;
+}
+
+// Returns the number of regressions against the baseline
+int RunConvergence(TileScheduler &scheduler, std::vector<std::thread> &threads) {
+    int pass = 0;
+    auto reference = [&](float *rgb) {
+        renderingReference = true;
+        renderSeed = SEED + 1;
+        RunPass(scheduler, threads, 0);
+        framebuffer.resolve(rgb);
+        framebuffer.clear();
+        for (int i = 0; i < WIDTH * HEIGHT; i++) stats[i] = PixelStats();
+        renderingReference = false;
+        renderSeed = SEED;
+    };
+    auto batch = [&](float *rgb) {
+        if (pass > 0 && RemainingPixels(pass) == 0) return 0.f;
+        RunPass(scheduler, threads, pass++);
+        framebuffer.resolve(rgb);
+        return framebuffer.averageSamples();
+    };
+    return RunConvergence("raymarcher", WIDTH, HEIGHT, CONVERGENCE_SECONDS, reference, batch);
+}
+
+// Marks the tiles and paths this process leaves to other shards
+bool SetupShard(const char *option, const char *value) {
+    if (sscanf(value, "%d/%d", &shardIndex, &shardCount) != 2 || shardIndex < 0 || shardIndex >= shardCount) {
+        printf("%s takes index/count, e.g. 0/4.\n", option);
+        return false;
+    }
+    sampleShards = strcmp(option, "--samples") == 0;
+    if (sampleShards) {
+        if (ADAPTIVE || CONVERGENCE) {
+            printf("--samples can't be used with ADAPTIVE or CONVERGENCE.\n");
+            return false;
+        }
+        sampleFirst = SAMPLES * shardIndex / shardCount;
+        sampleEnd = SAMPLES * (shardIndex + 1) / shardCount;
+    } else {
+        // Interleaved, so every shard gets some of the expensive tiles
+        for (int i = 0; i < TILES_X * TILES_Y; i++) tileOutside[i] = i % shardCount != shardIndex;
+        tileDone = tileOutside;
+    }
+    snprintf(checkpointFile, sizeof(checkpointFile), "%s.%d", CHECKPOINT_FILE, shardIndex);
+    return true;
+}
+
+// Usage: main [--tiles index/count | --samples index/count] [--threads count] [scene file] [output file]
+int main(int argc, char **argv) {
+    bool sharded = false;
+    unsigned int threadOption = 0;
+    int options = 0;
+    for (; 1 + options < argc && strncmp(argv[1 + options], "--", 2) == 0; options += 2) {
+        const char *option = argv[1 + options];
+        if (2 + options >= argc) {
+            printf("%s needs a value.\n", option);
+            return -1;
+        }
+        const char *value = argv[2 + options];
+        if (strcmp(option, "--tiles") == 0 || strcmp(option, "--samples") == 0) {
+            if (sharded) {
+                printf("Only one of --tiles and --samples can be given.\n");
+                return -1;
+            }
+            if (!SetupShard(option, value)) return -1;
+            sharded = true;
+        } else if (strcmp(option, "--threads") == 0) {
+            threadOption = atoi(value);
+        } else {
+            printf("Unknown option %s.\n", option);
+            return -1;
+        }
+    }
+    // The rest are read as if there were no options
+    argc -= options;
+    argv += options;
+
+    char shardFilename[256];
+    snprintf(shardFilename, sizeof(shardFilename), SHARD_FILENAME, shardIndex);
+    const char *filename = argc > 2 ? argv[2] : sharded ? shardFilename : FILENAME;
+    if (argc > 1) {
+        if (!LoadScene(argv[1], sceneFile)) return -1;
+        useSceneFile = true;
+        printf("Loaded %s, %d instructions.\n", argv[1], (int)sceneFile.program.code.size());
+        if (sceneFile.hasCamera) {
+            cameraPos = sceneFile.cameraPosition;
+            azimuth = sceneFile.cameraAzimuth;
+            cameraZRot = sceneFile.cameraZRot;
+            camera.fov = sceneFile.cameraFov;
+        }
     }
-    fprintf(fp, "P6 %d %d 255\n", WIDTH, HEIGHT);
 
     camera.setPosition(cameraPos);
     camera.setZRot(cameraZRot);
     camera.setAzimuth(azimuth);
     camera.cacheLookDir();
 
-    printf("Rendering %d tiles @ %dX%d...\n", TILE_H_COUNT * TILE_W_COUNT, TILE_WIDTH, TILE_HEIGHT);
+    if (SCENE == SCENE_BVH && !useSceneFile) {
+        BuildBvhScene();
+        printf("Built BVH over %d primitives.\n", bvhScene.primitiveCount());
+    }
 
     // Setup threads
-    const unsigned int n_threads = std::thread::hardware_concurrency();
-    printf("Detected %d threads.\n", n_threads);
+    unsigned int n_threads = threadOption ? threadOption : std::thread::hardware_concurrency();
+    if (n_threads == 0) n_threads = 1;
+    printf("%s %d threads.\n", threadOption ? "Using" : "Detected", n_threads);
+    if (CONVERGENCE && sharded) {
+        printf("Sharded renders can't run the convergence test.\n");
+        return -1;
+    }
+
+    if (DISTANCE_CACHE) SetupDistanceCache(n_threads);
     std::vector<std::thread> threads{n_threads};
 
-    stopwatch runtime;
-    
-    for (auto &t : threads) t = std::thread{Task{}};
+    TileScheduler scheduler(WIDTH, HEIGHT, TILE_WIDTH, TILE_HEIGHT, n_threads, TILE_ORDER);
+    printf("Rendering %d tiles @ %dX%d...\n", scheduler.tileCount(), TILE_WIDTH, TILE_HEIGHT);
+
+    if (CONVERGENCE) return RunConvergence(scheduler, threads) ? 1 : 0;
 
-    // Wait for threads to finish (is this good?)
-    while (doneThreads != n_threads) {
-        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    int firstPass = 0;
+    if (CHECKPOINT) {
+        if (ReadCheckpoint(checkpointFile, ShardCheckpointKey(), CheckpointState(firstPass))) {
+            printf("Resuming from %s in pass %d with %d of %d tiles done.\n", checkpointFile, firstPass,
+                (int)std::count(tileDone.begin(), tileDone.end(), 1), (int)tileDone.size());
+        }
+        checkpointing = true;
+        checkpointTime = stopwatch();
     }
 
-    for (auto &t: threads) t.join();
+    stopwatch runtime;
+
+    for (int pass = firstPass; ; pass++) {
+        RunPass(scheduler, threads, pass);
+        if (!ADAPTIVE) break;
+
+        int remaining = RemainingPixels(pass + 1);
+        printf("Pass %d done, %d pixels still above the error target.\n", pass, remaining);
+        if (remaining == 0) break;
+    }
 
+    double renderSeconds = runtime.elapsed_micros() / 1e6;
     long long millis = runtime.elapsed_millis();
     float seconds = (float)millis / 1000.;
-    printf("Took %f seconds, avg. of %f tiles per second\n", seconds, TILE_H_COUNT * TILE_W_COUNT / seconds);
-
-    for (int i = 0; i < WIDTH * HEIGHT * 3; i++) {
-        fprintf(fp, "%c", pixels[i]);
+    printf("Took %f seconds, avg. of %f tiles per second\n", seconds, scheduler.tileCount() / seconds);
+    printf("Marched %llu rays, %f steps per ray, %llu (%f%%) hit the step cap.\n",
+        (unsigned long long)totalMarchStats.rays, (float)totalMarchStats.steps / totalMarchStats.rays,
+        (unsigned long long)totalMarchStats.capped, 100.f * totalMarchStats.capped / totalMarchStats.rays);
+    printf("%f distance evaluations per ray.\n", (float)totalMarchStats.evaluations / totalMarchStats.rays);
+    if (CONE_MARCH) {
+        printf("Marched %llu cones, %f steps per cone.\n",
+            (unsigned long long)totalMarchStats.cones, (float)totalMarchStats.coneSteps / totalMarchStats.cones);
     }
 
-    fclose(fp);
-}
+    float samplesPerPixel = framebuffer.averageSamples();
+    if (ADAPTIVE) printf("Traced %f paths per pixel on average.\n", samplesPerPixel);
+    WriteBenchmark({ "raymarcher", WIDTH, HEIGHT, samplesPerPixel, renderSeconds,
+        totalMarchStats.rays, totalMarchStats.steps, totalMarchStats.evaluations });
 
-Vector Trace(Ray ray, int samples, int depth) {
-    if (depth > BOUNCES) return Vector(0);
+    // The rest needs the whole image, so it is left to merge.cpp
+    if (sharded) {
+        if (!framebuffer.save(filename, RenderKey(), shardIndex, shardCount, sampleShards)) {
+            printf("Failed to write %s.\n", filename);
+            return -1;
+        }
+        printf("Wrote shard %d of %d to %s.\n", shardIndex, shardCount, filename);
+        if (CHECKPOINT) remove(checkpointFile);
+        return 0;
+    }
 
-    RayHit surface = RayMarch(ray, &GetDistance);
+    if (DENOISE) {
+        stopwatch denoiseTime;
+        Denoiser denoiser;
+        denoiser.iterations = DENOISE_ITERATIONS;
+        std::vector<Vector> radiance(WIDTH * HEIGHT);
+        for (int i = 0; i < WIDTH * HEIGHT; i++) radiance[i] = framebuffer.mean(i);
+        denoiser.run(radiance.data(), albedoBuffer, normalBuffer, depthBuffer, WIDTH, HEIGHT, radiance.data(), n_threads);
+        for (int i = 0; i < WIDTH * HEIGHT; i++) framebuffer.setMean(i, radiance[i]);
+        printf("Denoised in %f seconds.\n", denoiseTime.elapsed_millis() / 1000.);
+    }
+
+    if (WRITE_FEATURES) WriteFeatures();
+    if (HEATMAP) WriteHeatmaps();
+
+    bool written;
+    if (HasExtension(filename, ".pfm") || HasExtension(filename, ".exr")) {
+        std::vector<float> radiance(WIDTH * HEIGHT * 3);
+        framebuffer.resolve(radiance.data());
+        written = WriteImage(filename, radiance.data(), WIDTH, HEIGHT);
+    } else {
+        stopwatch toneMapTime;
+        framebuffer.toneMap(pixels, n_threads);
+        printf("Tone mapped in %f ms.\n", toneMapTime.elapsed_micros() / 1000.);
+        written = WriteImage(filename, pixels, WIDTH, HEIGHT);
+    }
+    if (!written) {
+        printf("Failed to write %s.\n", filename);
+        return -1;
+    }
+    if (CHECKPOINT) remove(checkpointFile);
+}
 
+Vector Shade(RayHit surface, int samples, Sampler sampler, int depth) {
     // Special case for sky
     if (surface.material == 0) return Vector(0); // sky color
 
-    Vector incoming = IncomingLuminance(surface, samples, depth);
+    Vector incoming = IncomingLuminance(surface, samples, sampler, depth);
 
     // Could ray march and get material to determine emission
     Vector emission(0);
@@ -176,37 +714,9 @@ Vector Trace(Ray ray, int samples, int depth) {
     return emission + incoming;
 }
 
-Vector GetReflectionRay(Vector normal, Vector incoming, float roughness, float *probability) {
-    std::normal_distribution<float> distribution(0.0, roughness / ROOT2);
-    std::uniform_real_distribution<float> uniform(-PI, PI);
-
-    Vector up = normal;
-    Vector right = up.cross(-incoming);
-    Vector forward = up.cross(right);
-    
-    const float pi2 = PI / 2;
-    float xzRand = uniform(generator);
-    float zyRand = distribution(generator);
-    float xzTheta = min(fabsf(xzRand), 2*PI) * (xzRand < 0 ? -1 : 1);
-    float zyTheta = min(fabsf(zyRand), pi2) * (zyRand < 0 ? -1 : 1);
-
-    float sinXZ, cosXZ;
-    sincosf(xzTheta, &sinXZ, &cosXZ);
-    float sinZY, cosZY;
-    sincosf(zyTheta, &sinZY, &cosZY);
-
-    Vector halfRay = (right * sinXZ + forward * cosXZ) * sinZY + up * cosZY;
-    halfRay = halfRay;
-
-    Vector reflectRay = incoming + halfRay * (halfRay % incoming * -2);
-    // Very long print statement for debugging purposes
-    // printf("actual: %6.3f, expected: %6.3f, normal: (%6.3f, %6.3f, %6.3f), half: (%6.3f, %6.3f, %6.3f)\n", angle, zyTheta, normal.x, normal.y, normal.z, halfRay.x, halfRay.y, halfRay.z);
-    *probability = expf(- zyTheta * zyTheta / roughness / roughness);
-
-    return reflectRay;
-}
-
-Vector IncomingLight(RayHit hit, Vector &lightDir) {
+// Light reaching a surface from the point light if nothing is in the
+// way, and the ray that decides whether something is
+Vector LightSample(RayHit hit, Vector &lightDir, Ray &shadowRay, float &lightDistance) {
     int material = hit.material;
     Vector normal = hit.normal;
     Vector hitPos = hit.hitPos;
@@ -214,7 +724,7 @@ Vector IncomingLight(RayHit hit, Vector &lightDir) {
     if (material == 0) return Vector(0);
 
     Vector lightPos(0, 5, 0);
-    Vector lightColor = Vector(1, 0.95, 0.85) * 2;
+    Vector lightColor = Vector(1, 0.95, 0.85) * PI;
     float sqrLightRange = 15 * 15;
 
     Vector lightDisp = lightPos - hitPos;
@@ -222,125 +732,189 @@ Vector IncomingLight(RayHit hit, Vector &lightDir) {
 
     float sqrLightDist = lightDisp.sqrMagnitude();
     float lightPower = max(0, (sqrLightRange - sqrLightDist) / sqrLightRange);
-    float lightStrength = lightPower;
-
-    if (lightStrength > 0) {
-        Ray lightRay = {
-            hitPos + normal * 0.05,
-            lightDir
-        };
-        RayHit lightCast = RayMarch(lightRay, &GetDistance, sqrtf(sqrLightDist));
-        if (lightCast.material != 0) {
-            lightStrength = 0;
-        }
+
+    shadowRay = {
+        hitPos + normal * 0.05,
+        lightDir
+    };
+    lightDistance = sqrtf(sqrLightDist);
+    return lightColor * lightPower;
+}
+
+Vector IncomingLight(RayHit hit, Vector &lightDir) {
+    Ray shadowRay;
+    float lightDistance;
+    Vector light = LightSample(hit, lightDir, shadowRay, lightDistance);
+    if (light.x > 0) {
+        float visibility = MarchVisibility(shadowRay, &GetDistance, lightDistance, SHADOW_SOFTNESS, marchCache);
+        if (visibility < 1) light = light * visibility;
     }
+    return light;
+}
+
+Vector ballColor(1, 0.6, 0.9);
+Vector glassColor(0.3, 0.5, 1);
 
-    return lightColor * lightStrength;
+// Balls are glossy metal
+Ggx BallBsdf(int material) {
+    return material == 1 ? Ggx{ballColor, 0.05} : Ggx{glassColor, 0.1};
 }
-Vector IncomingLuminance(RayHit surface, int samples, int depth) {
-    if (depth > BOUNCES) return Vector(0);
 
-    Ray ray = surface.ray;
+// Color a surface tints the light it reflects with, for the denoiser
+Vector SurfaceAlbedo(RayHit surface) {
     int material = surface.material;
-    Vector normal = surface.normal;
-    Vector hitPos = surface.hitPos;
-
-    Vector lightDir;
-    Vector incomingLight = IncomingLight(surface, lightDir);
+    if (material == 1 || material == 3) return BallBsdf(material).reflectance;
+    if (material == 2) return CheckerColor(surface.hitPos);
+    return Vector(1);
+}
 
-    Vector sum(0);
+// Part of the light arriving from lightDir that a surface reflects back
+// along its ray
+Vector ReflectedLight(RayHit surface, Vector lightDir, Vector incomingLight) {
+    int material = surface.material;
+    Frame frame(surface.normal);
+    Vector wo = -surface.ray.direction;
 
-    Vector ballColor(1, 0.6, 0.9);
-    Vector glassColor(0.3, 0.5, 1);
+    if (material == 1 || material == 3) {
+        return BallBsdf(material).evaluate(frame, wo, lightDir) * incomingLight;
+    } else if (material == 2) {
+        // Floor
+        Lambert floor{CheckerColor(surface.hitPos)};
+        return floor.evaluate(frame, wo, lightDir) * incomingLight;
+    }
+    return incomingLight;
+}
 
-    float ballRoughness = material == 1 ? 0.05 : 0.1;
+// Picks the direction a path goes on in after a surface, and the weight
+// of the light that comes back along it. Returns false for surfaces
+// that don't reflect, and for samples that don't leave the surface.
+bool BounceRay(RayHit surface, Sampler &path, Ray &bounce, Vector &weight) {
+    int material = surface.material;
+    Frame frame(surface.normal);
+    Vector wo = -surface.ray.direction;
 
+    BsdfSample sample;
     if (material == 1 || material == 3) {
-        // Ball incoming light
-        Vector halfLight = !(lightDir + -ray.direction);
-        float lightAngle = normal.angleTo(halfLight);
-        // Gaussian microfacet brdf
-        float lightStrength = exp(-lightAngle * lightAngle / (ballRoughness * ballRoughness));
-        incomingLight = incomingLight * lightStrength / TWO_PI;
+        float u1 = path.next();
+        sample = BallBsdf(material).sample(frame, wo, u1, path.next());
     } else if (material == 2) {
         // Floor
-        Vector reflectance = CheckerColor(hitPos);
-        incomingLight = reflectance * incomingLight * (lightDir % normal) / TWO_PI;
+        Lambert floor{CheckerColor(surface.hitPos)};
+        float u1 = path.next();
+        sample = floor.sample(frame, wo, u1, path.next());
+    } else {
+        return false;
     }
-    sum = incomingLight * samples;
+    if (sample.weight.x <= 0 && sample.weight.y <= 0 && sample.weight.z <= 0) return false;
+
+    bounce = {
+        surface.hitPos + surface.normal * 0.05,
+        sample.direction
+    };
+    weight = sample.weight;
+    return true;
+}
+
+Vector IncomingLuminance(RayHit surface, int samples, Sampler sampler, int depth) {
+    if (depth > BOUNCES) return Vector(0);
+
+    Vector lightDir;
+    Vector incomingLight = IncomingLight(surface, lightDir);
+    Vector sum = ReflectedLight(surface, lightDir, incomingLight) * samples;
 
     for (int p = samples; p--;) {
-        if (material == 1 || material == 3) {
-            // Ball
-            float rayProbability;
-            Vector newDir = GetReflectionRay(normal, ray.direction, ballRoughness, &rayProbability);
-            Ray reflectRay = {
-                hitPos + normal * 0.05,
-                newDir
-            };
-            Vector halfVector = !(newDir + ray.direction);
-            float reflectAngle = acosf(halfVector % normal);
-            float reflectStrength = expf(-reflectAngle * reflectAngle / 0.01);
-            Vector L_i = Trace(reflectRay, 1, depth + 1);
-            Vector reflectance = material == 1 ? ballColor : glassColor;
-
-            Vector value = reflectance * L_i / 1;
-            sum = sum + value;
-        } else if (material == 2) {
-            // Floor
-            Vector reflectance = CheckerColor(hitPos);
-
-            // Incoming light
-            Vector tangent = normal.cross(ray.direction);
-            Vector bitangent = normal.cross(tangent);
-            float theta = random() * TWO_PI;
-            float phi = random() * PI / 2;
-            Vector newDir = (tangent * cosf(theta) + bitangent * sinf(theta)) * cosf(phi) + normal * sinf(phi);
-            Ray newRay = {
-                hitPos + normal * 0.05,
-                newDir
-            };
-            Vector L_i = Trace(newRay, 1, depth + 1) * newDir % normal;
-
-            Vector value = reflectance * L_i / TWO_PI;
-
-            sum = sum + value;
+        Sampler path = sampler.split(p, samples);
+        path.startBounce(depth);
+        Ray bounce;
+        Vector weight;
+        if (BounceRay(surface, path, bounce, weight)) {
+            if (depth < BOUNCES) sum = sum + weight * TracePath(bounce, path, depth + 1);
         }
     }
 
-    // Final step of monte carlo integration:
-    // divide by samples and multiply by set volume
-    sum = sum / (samples * 2) * TWO_PI;
-    return sum;
+    // Samples are drawn in proportion to the BSDF, so their weights
+    // already hold f * cos / pdf and only need averaging
+    return sum / samples;
 }
 
-float GetDistance(Vector p, int &hitType) {
-    float distance = 1e9;
-
-    // Infinite reflective spheres
-    float x = fmodf(fabsf(p.x), 4);
-    float z = fmodf(fabsf(p.z), 4);
-    Vector modP = Vector(x, p.y, z);
-    Vector displacement = Vector(2, 1, 2) - modP;
-
-    distance = displacement.magnitude() - 1;
-    hitType = 1;
+// Russian roulette for a path whose throughput has dropped below 1: ends
+// it with probability 1 - throughput by returning 0, or returns what the
+// surviving path's weight has to be scaled by to make up for the ones
+// that ended
+float RouletteWeight(Vector throughput, Sampler &sampler) {
+    float survival = fmaxf(throughput.x, fmaxf(throughput.y, throughput.z));
+    if (survival >= 1) return 1;
+    if (sampler.next() >= survival) return 0;
+    return 1 / survival;
+}
 
-    // Glass sphere
-    float glassDist = (Vector(0, 1, 0) - p).magnitude() - 1.5;
-    if (glassDist < distance) {
-        distance = glassDist;
-        hitType = 3;
+// Light that comes back along ray, from the path that continues it with
+// its next hit at the given depth. The path is followed one bounce at a
+// time without recursing, keeping track of its throughput.
+Vector TracePath(Ray ray, Sampler sampler, int depth) {
+    Vector radiance(0);
+    Vector throughput(1);
+    for (; depth <= BOUNCES; depth++) {
+        RayHit surface = RayMarch(ray, &GetDistance, &GetGradient, marchCache);
+        if (surface.material == 0) break;
+
+        sampler.startBounce(depth);
+
+        Vector lightDir;
+        Vector incomingLight = IncomingLight(surface, lightDir);
+        radiance = radiance + throughput * ReflectedLight(surface, lightDir, incomingLight);
+
+        Vector weight;
+        if (depth == BOUNCES || !BounceRay(surface, sampler, ray, weight)) break;
+        throughput = throughput * weight;
+        if (depth >= RR_MIN_DEPTH) {
+            float roulette = RouletteWeight(throughput, sampler);
+            if (roulette == 0) break;
+            throughput = throughput * roulette;
+        }
     }
+    return radiance;
+}
+
+// Same estimate as IncomingLuminance, one bounce at a time for the
+// wavefront engine. Paths split into SAMPLES at the first hit and go on
+// as single paths after that.
+void ShadeWavefront(const PathState &path, const RayHit &surface, std::vector<PathState> &next, std::vector<ShadowRay> &shadows) {
+    if (surface.material == 0) return;
 
+    int samples = path.depth == 0 ? SAMPLES : 1;
+    // Each term of IncomingLuminance's sum ends up scaled by this
+    Vector scale = path.weight / samples;
 
-    float floorDist = p.y;
-    if (floorDist < distance) {
-        distance = floorDist;
-        hitType = 2;
+    Vector lightDir;
+    ShadowRay shadow;
+    Vector light = LightSample(surface, lightDir, shadow.ray, shadow.distance);
+    if (light.x > 0) {
+        shadow.light = ReflectedLight(surface, lightDir, light) * samples * scale;
+        shadow.pixel = path.pixel;
+        shadows.push_back(shadow);
     }
 
-    return distance;
+    if (path.depth + 1 > BOUNCES) return;
+    for (int p = samples; p--;) {
+        PathState bounce;
+        bounce.sampler = path.sampler.split(p, samples);
+        bounce.sampler.startBounce(path.depth);
+        Vector weight;
+        if (!BounceRay(surface, bounce.sampler, bounce.ray, weight)) continue;
+        bounce.throughput = Vector(1);
+        if (path.depth > 0) {
+            bounce.throughput = path.throughput * weight;
+            float roulette = path.depth >= RR_MIN_DEPTH ? RouletteWeight(bounce.throughput, bounce.sampler) : 1;
+            if (roulette == 0) continue;
+            bounce.throughput = bounce.throughput * roulette;
+            weight = weight * roulette;
+        }
+        bounce.weight = weight * scale;
+        bounce.pixel = path.pixel;
+        bounce.depth = path.depth + 1;
+        next.push_back(bounce);
+    }
 }
 
 Vector CheckerColor(Vector pos) {
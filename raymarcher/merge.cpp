@@ -0,0 +1,87 @@
+// Combines the framebuffers written by sharded renders (main --tiles or
+// main --samples) into the final image. Shards hold radiance sums and
+// path counts, so tile and sample shards both merge by adding them up.
+// Merged tile shards hold exactly the radiance of a single render.
+// Sample shards add up each pixel's paths in another order, so theirs
+// only matches it to within float rounding.
+// Build it on its own, with the same flags as main.cpp:
+//   g++ -O2 merge.cpp -o merge -pthread
+//   ./merge image.png shard_0.fb shard_1.fb ...
+// A .pfm or .exr output gets the radiance before tone mapping. Every
+// shard of the render has to be given, once.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <thread>
+#include "Framebuffer.hpp"
+#include "../Image.hpp"
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        printf("Usage: merge output shard...\n");
+        return -1;
+    }
+    const char *filename = argv[1];
+
+    Framebuffer image(0, 0), shard(0, 0);
+    uint64_t key = 0, shardKey;
+    int count = 0, index, shardCount;
+    bool samples = false, sampleShards;
+    std::vector<char> seen;
+    for (int i = 2; i < argc; i++) {
+        if (!shard.load(argv[i], shardKey, index, shardCount, sampleShards)) {
+            printf("Failed to read %s.\n", argv[i]);
+            return -1;
+        }
+        if (i == 2) {
+            image = shard;
+            key = shardKey;
+            count = shardCount;
+            samples = sampleShards;
+            seen.assign(count, 0);
+        } else if (shard.width != image.width || shard.height != image.height || shardKey != key ||
+            shardCount != count || sampleShards != samples) {
+            printf("%s is from a different render than %s.\n", argv[i], argv[2]);
+            return -1;
+        }
+        if (seen[index]) {
+            printf("%s is shard %d of %d again.\n", argv[i], index, count);
+            return -1;
+        }
+        seen[index] = 1;
+        if (i > 2) image.add(shard);
+    }
+    for (int i = 0; i < count; i++) {
+        if (!seen[i]) {
+            printf("Shard %d of %d is missing.\n", i, count);
+            return -1;
+        }
+    }
+
+    int missing = 0, fewest = 1 << 30, most = 0;
+    for (int c : image.counts) {
+        missing += c == 0;
+        fewest = c < fewest ? c : fewest;
+        most = c > most ? c : most;
+    }
+    printf("Merged %d shards, %d to %d paths per pixel.\n", argc - 2, fewest, most);
+    if (missing) printf("%d pixels have no paths, is a shard missing?\n", missing);
+
+    int width = image.width, height = image.height;
+    bool written;
+    if (HasExtension(filename, ".pfm") || HasExtension(filename, ".exr")) {
+        std::vector<float> radiance((size_t)width * height * 3);
+        image.resolve(radiance.data());
+        written = WriteImage(filename, radiance.data(), width, height);
+    } else {
+        std::vector<unsigned char> pixels((size_t)width * height * 3);
+        unsigned int threads = std::thread::hardware_concurrency();
+        image.toneMap(pixels.data(), threads ? threads : 1);
+        written = WriteImage(filename, pixels.data(), width, height);
+    }
+    if (!written) {
+        printf("Failed to write %s.\n", filename);
+        return -1;
+    }
+    return 0;
+}
@@ -16,6 +16,11 @@ public:
         auto micros = std::chrono::duration_cast<std::chrono::milliseconds>(finish-start);
         return micros.count();
     }
+
+    long long elapsed_micros() {
+        auto finish = std::chrono::high_resolution_clock::now();
+        return std::chrono::duration_cast<std::chrono::microseconds>(finish-start).count();
+    }
 };
 
 #endif // _STOPWATCH_H
\ No newline at end of file
@@ -5,6 +5,5 @@
 
 float min(float l, float r) { return l < r ? l : r; }
 float max(float l, float r) { return l > r ? l : r; }
-float random() { return (float)rand() / RAND_MAX; }
 
 #endif
\ No newline at end of file
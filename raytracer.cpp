@@ -1,6 +1,8 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <math.h>
+#include "Image.hpp"
+#include "Benchmark.hpp"
 
 struct Vec {
     float x, y, z;
@@ -34,7 +36,7 @@ struct Vec {
 #define HIT_SUN 6
 
 float min(float l, float r) { return l < r ? l : r; }
-float random() { return (float)rand() / RAND_MAX; }
+float RandomFloat() { return (float)rand() / RAND_MAX; }
 
 float BoxTest(Vec p, Vec c1, Vec c2) {
     c1 = p + c1 * -1;
@@ -52,8 +54,13 @@ float SphereTest(Vec p, Vec c, float r) {
     return sqrtf(d%d) - r;
 }
 
+uint64_t totalRays = 0;
+uint64_t totalSteps = 0;
+uint64_t totalEvaluations = 0;
+
 // CSG function to find distance and type of objects
 float Query(Vec p, int &hitType) {
+    totalEvaluations++;
     float distance = 1e9;
     hitType = HIT_NONE;
 
@@ -91,8 +98,10 @@ int RayMarch(Vec origin, Vec direction, Vec &hitNorm, Vec &hitPos) {
     float d;
     int noHitCount;
     int hitType;
+    totalRays++;
     
     for (float total_d = 0; total_d < 100; total_d += d) {
+        totalSteps++;
         hitPos = origin + direction * total_d;
         d = Query(hitPos, hitType);
         if (d < 0.01 || ++noHitCount > 99) {
@@ -117,8 +126,8 @@ to get random vector in hemisphere:
 Vec B = Vec(normal.y, -normal.x, 0);
 Vec C = B.cross(normal);
 
-float angle = 6.28318531 * random();
-float height = random();
+float angle = 6.28318531 * RandomFloat();
+float height = RandomFloat();
 
 Vec final = normal * height + B * sinf(angle) + C * cosf(angle);
 // that should work
@@ -178,25 +187,33 @@ int main() {
     Vec up = Vec(0, 1, 0) * (1. / w);
     Vec left = target.cross(up) * -1;
 
-    FILE *fp = fopen("out.ppm", "wb");
-    fprintf(fp, "P6 %d %d 255\n", w, h);
+    std::vector<unsigned char> pixels(w * h * 3);
+    uint64_t start = BenchmarkMicros();
     for (int y = h; y--;) {
         for (int x = 0; x < w; x++) {
             Vec color;
             for (int p = 0; p < samples; p++) {
-                Vec direction = !(target + left * (x - w / 2 + random()) + up * (y - h / 2 + random()));
+                Vec direction = !(target + left * (x - w / 2 + RandomFloat()) + up * (y - h / 2 + RandomFloat()));
                 color = color + Trace(position, direction);
             }
             color = color * (1. / samples);
             color = color.limit(255);
-            fprintf(fp, "%c%c%c",(int)color.x, (int)color.y, (int)color.z);
+            int i = ((h - 1 - y) * w + x) * 3;
+            pixels[i] = (int)color.x;
+            pixels[i + 1] = (int)color.y;
+            pixels[i + 2] = (int)color.z;
         }
         if (fmodf(y, 1000) == 1001) {
             printf("%c", up);
             printf("%c", left);
         }
     }
-    fclose(fp);
+    uint64_t end = BenchmarkMicros();
+    if (!WriteImage("out.ppm", pixels.data(), w, h)) {
+        printf("Failed to write out.ppm");
+        return -1;
+    }
+    WriteBenchmark({ "raytracer", w, h, (float)samples, (end - start) / 1e6, totalRays, totalSteps, totalEvaluations });
 
     return 0;
 }
\ No newline at end of file
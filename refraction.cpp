@@ -3,6 +3,9 @@
 #include <math.h>
 #include <chrono>
 #include <inttypes.h>
+#include "Image.hpp"
+#include "Benchmark.hpp"
+#include "Convergence.hpp"
 
 #define M_PI 3.1415926
 
@@ -48,7 +51,7 @@ struct HitInfo {
 };
 
 float min(float l, float r) { return l < r ? l : r; }
-float random() { return (float)rand() / RAND_MAX; }
+float RandomFloat() { return (float)rand() / RAND_MAX; }
 
 float BoxTest(Vec p, Vec c1, Vec c2) {
     c1 = p + c1 * -1;
@@ -65,7 +68,10 @@ float SphereTest(Vec p, Vec c, float r) {
     Vec d = c + p * -1;
     return sqrtf(d%d) - r;
 }
+uint64_t totalEvaluations = 0;
+
 HitInfo Query(Vec position) {
+    totalEvaluations++;
     float distance = 1e9;
     int hitType = HIT_NONE;
 
@@ -82,12 +88,14 @@ HitInfo Query(Vec position) {
 }
 
 uint64_t totalRays = 0;
+uint64_t totalSteps = 0;
 // Signed sphere distance ray marching
 Ray RayCast(Vec origin, Vec direction) {
     totalRays++;
     float d = 0;
     int noHitCount = 0;
     for (float total_d = 0; total_d < 100; total_d += d) {
+        totalSteps++;
         Vec hitPoint = origin + direction * total_d;
         HitInfo info = Query(hitPoint);
         d = info.distance;
@@ -114,6 +122,7 @@ Ray SubsurfaceRayCast(Vec origin, Vec direction) {
     float d = 0;
     int noHitCount = 0;
     for (float total_d = 0; total_d < 100; total_d = d) {
+        totalSteps++;
         Vec hitPoint = origin + direction * total_d;
         HitInfo info = Query(hitPoint);
         d = -info.distance;
@@ -138,8 +147,8 @@ Vec UniformHemisphereSampler(Vec normal) {
     Vec tangent = Vec(normal.y, -normal.x);
     Vec bitangent = tangent.cross(normal);
 
-    float angle = 6.28318531 * random();
-    float height = random();
+    float angle = 6.28318531 * RandomFloat();
+    float height = RandomFloat();
     // Selects random unit vector in hemisphere of normal vector
     return !(normal * height + tangent * cosf(angle) + bitangent * sinf(angle));
 }
@@ -265,6 +274,15 @@ Vec GetCameraRay(float x, float y, const float w, const float h, const float fov
     return !(rayTarget + origin * -1);
 }
 
+// Run the equal-time convergence test in Convergence.hpp instead of a
+// single render. The reference gets CONVERGENCE_REFERENCE_SAMPLES paths
+// per pixel, and then CONVERGENCE_BATCH paths per pixel are added at a
+// time for CONVERGENCE_SECONDS.
+#define CONVERGENCE 0
+#define CONVERGENCE_REFERENCE_SAMPLES 1024
+#define CONVERGENCE_BATCH 2
+#define CONVERGENCE_SECONDS 60
+
 int main() {
     const int w = 1920 * 0.2;
     const int h = 1080 * 0.2;
@@ -279,41 +297,81 @@ int main() {
     Vec up = Vec(0, 1, 0);
     Vec right = target.cross(up);
 
-    FILE *fp;
-    errno_t err = fopen_s(&fp, "tracer2.ppm", "wb");
-    if (err != 0) {
-        return -1;
+    std::vector<unsigned char> pixels(w * h * 3);
+    // Radiance summed over the paths so far, rows top to bottom
+    std::vector<Vec> sums(w * h);
+
+    // Adds count more paths to the sum of every pixel
+    auto renderSamples = [&](int count) {
+        for (int y = h; y--;) {
+            for (int x = 0; x < w; x++) {
+                Vec &color = sums[(h - 1 - y) * w + x];
+                // Camera space ray
+                Vec cd = GetCameraRay((float)(w - x), (float)y, (float)w, (float)h, fov);
+                // World space ray
+                Vec direction = !(right * cd.x + up * cd.y + target * -cd.z);
+
+                // Focal point
+                Vec focal_point = position + direction * focal_length;
+
+                for (int p = 0; p < count; p++) {
+                    // Randomly offset origin
+                    Vec origin = position + right * ((RandomFloat() - 0.5) * aperture) + up * ((RandomFloat() - 0.5) * aperture);
+                    Vec dir = !(focal_point + origin * -1);
+                    color = color + TracePath(origin, dir);
+                }
+            }
+        }
+    };
+
+    if (CONVERGENCE) {
+        int rendered = 0;
+        // The reference gets its own random numbers, and the batches
+        // start over from the ones a normal render uses
+        auto reference = [&](float *rgb) {
+            srand(2);
+            renderSamples(CONVERGENCE_REFERENCE_SAMPLES);
+            for (int i = 0; i < w * h; i++) {
+                Vec color = sums[i] * (1. / CONVERGENCE_REFERENCE_SAMPLES);
+                rgb[i * 3] = color.x;
+                rgb[i * 3 + 1] = color.y;
+                rgb[i * 3 + 2] = color.z;
+                sums[i] = Vec();
+            }
+            srand(1);
+        };
+        auto batch = [&](float *rgb) {
+            renderSamples(CONVERGENCE_BATCH);
+            rendered += CONVERGENCE_BATCH;
+            for (int i = 0; i < w * h; i++) {
+                Vec color = sums[i] * (1. / rendered);
+                rgb[i * 3] = color.x;
+                rgb[i * 3 + 1] = color.y;
+                rgb[i * 3 + 2] = color.z;
+            }
+            return (float)rendered;
+        };
+        return RunConvergence("refraction", w, h, CONVERGENCE_SECONDS, reference, batch) ? 1 : 0;
     }
-    fprintf(fp, "P6 %d %d 255\n", w, h);
 
     uint64_t start = GetMicros();
-    for (int y = h; y--;) {
-        for (int x = 0; x < w; x++) {
-            Vec color;
-            // Camera space ray
-            Vec cd = GetCameraRay((float)(w - x), (float)y, (float)w, (float)h, fov);
-            // World space ray
-            Vec direction = !(right * cd.x + up * cd.y + target * -cd.z);
-
-            // Focal point
-            Vec focal_point = position + direction * focal_length;
-
-            for (int p = 0; p < samples; p++) {
-                // Randomly offset origin
-                Vec origin = position + right * ((random() - 0.5) * aperture) + up * ((random() - 0.5) * aperture);
-                Vec dir = !(focal_point + origin * -1);
-                color = color + TracePath(origin, dir);
-            }
-            color = color * (1. / samples) * 255;
-            color = color.limit(255);
-            fprintf(fp, "%c%c%c",(int)color.x, (int)color.y, (int)color.z);
-        }
+    renderSamples(samples);
+    for (int i = 0; i < w * h; i++) {
+        Vec color = sums[i] * (1. / samples) * 255;
+        color = color.limit(255);
+        pixels[i * 3] = (int)color.x;
+        pixels[i * 3 + 1] = (int)color.y;
+        pixels[i * 3 + 2] = (int)color.z;
     }
     uint64_t end = GetMicros();
-    fclose(fp);
+    if (!WriteImage("refraction.ppm", pixels.data(), w, h)) {
+        printf("Failed to write refraction.ppm");
+        return -1;
+    }
 
     float dtime = (float)(end - start) / 1e6;
     printf("Casted %" PRIu64 " rays in %f seconds @ %f rays per second", totalRays, dtime, (float)totalRays / dtime);
+    WriteBenchmark({ "refraction", w, h, (float)samples, (end - start) / 1e6, totalRays, totalSteps, totalEvaluations });
 
     return 0;
 }
\ No newline at end of file
@@ -2,6 +2,8 @@
 #include <stdlib.h>
 #include <math.h>
 #include <random>
+#include "../Image.hpp"
+#include "../Benchmark.hpp"
 
 #define SAMPLES 16
 #define BOUNCES 4
@@ -39,9 +41,14 @@ float SphereTest(Vec p, Vec c, float r) {
     return sqrtf(disp%disp) - r;
 }
 
+uint64_t totalRays = 0;
+uint64_t totalSteps = 0;
+uint64_t totalEvaluations = 0;
+
 #define HIT_NONE 0
 #define HIT_BALL 1
 float Distance(Vec p, int &hitType) {
+    totalEvaluations++;
     hitType = HIT_BALL;
     // float distance = SphereTest(p, Vec(-0.7, 1, 0), 1) + SphereTest(p, Vec(0.7, 1, 0), 0.8);
     float distance = SphereTest(p, Vec(0, 0, -5), 1);
@@ -51,7 +58,9 @@ float Distance(Vec p, int &hitType) {
 int RayMarch(Vec origin, Vec direction, Vec &hitPos, Vec &hitNorm) {
     float d;
     int noHitCount = 0;
+    totalRays++;
     for (float total_d = 0; total_d < 100; total_d += d) {
+        totalSteps++;
         hitPos = origin + direction * total_d;
         int hitType = 0;
         d = Distance(hitPos, hitType);
@@ -117,8 +126,9 @@ int main() {
     Vec up = Vec(0, 1, 0) * (1. / w);
     Vec right = goal.cross(up);
 
-    char pixels[w * h * 3];
+    unsigned char pixels[w * h * 3];
     printf("Starting path tracing...\n");
+    uint64_t start = BenchmarkMicros();
     for (int y = h; y--;) {
         for (int x = w; x--;) {
             Vec direction = !(goal + right * (x - w/2) + up * (y - h/2));
@@ -129,19 +139,15 @@ int main() {
             pixels[i + 2] = (int)(color.z * 255);
         }
     }
+    uint64_t end = BenchmarkMicros();
     printf("Finished path tracing, now outputting to 'simple.ppm'\n");
 
-    FILE *fp;
-    if (fopen_s(&fp, "simple.ppm", "wb") != 0) {
-        printf("Failed to open output file");
+    if (!WriteImage("simple.ppm", pixels, w, h)) {
+        printf("Failed to write output file");
         return -1;
     }
-    fprintf(fp, "P6 %d %d 255\n", w, h);
-    for (int i = 0; i < w * h * 3; i++) {
-        fprintf(fp, "%c", pixels[i]);
-    }
-    fclose(fp);
     printf("All done!");
+    WriteBenchmark({ "simple", w, h, SAMPLES, (end - start) / 1e6, totalRays, totalSteps, totalEvaluations });
 
     return 0;
 }
\ No newline at end of file
@@ -3,6 +3,11 @@
 #include <math.h>
 #include <chrono>
 #include <inttypes.h>
+#include "Image.hpp"
+#include "raymarcher/Sampler.hpp"
+#include "Benchmark.hpp"
+#include "Convergence.hpp"
+#include "Checkpoint.hpp"
 
 #define M_PI 3.1415926
 
@@ -53,7 +58,6 @@ struct HitInfo {
 };
 
 float min(float l, float r) { return l < r ? l : r; }
-float random() { return (float)rand() / RAND_MAX; }
 
 float BoxTest(Vec p, Vec c1, Vec c2) {
     c1 = p + c1 * -1;
@@ -70,7 +74,10 @@ float SphereTest(Vec p, Vec c, float r) {
     Vec d = c + p * -1;
     return sqrtf(d%d) - r;
 }
+uint64_t totalEvaluations = 0;
+
 HitInfo Query(Vec position) {
+    totalEvaluations++;
     float distance = 1e9;
     int hitType = HIT_NONE;
 
@@ -132,16 +139,31 @@ HitInfo Query(Vec position) {
 }
 
 uint64_t totalRays = 0;
+uint64_t totalSteps = 0;
+uint64_t cappedRays = 0; // Rays that used up their step budget
+
+// Steps go this many times the distance; a step that skipped past the
+// previous sphere is retaken at 1x
+#define MARCH_RELAXATION 1.6
+
 // Signed sphere distance ray marching
 Ray RayCast(Vec origin, Vec direction) {
     totalRays++;
     float d = 0;
     int noHitCount = 0;
-    for (float total_d = 0; total_d < 100; total_d += d) {
+    float relaxation = MARCH_RELAXATION;
+    float lastDist = 0;
+    float lastStep = 0;
+    for (float total_d = 0; total_d < 100;) {
+        totalSteps++;
         Vec hitPoint = origin + direction * total_d;
         HitInfo info = Query(hitPoint);
         d = info.distance;
-        if (info.distance < 0.01) {
+        if (relaxation > 1 && fabsf(d) + lastDist < lastStep) {
+            total_d += lastDist - lastStep;
+            lastStep = lastDist;
+            relaxation = 1;
+        } else if (info.distance < 0.01) {
             return {
                 info.hitType,
                 origin,
@@ -153,7 +175,13 @@ Ray RayCast(Vec origin, Vec direction) {
                     Query(hitPoint + Vec(0, 0, 0.01)).distance - d
                 )
             };
-        } else if (++noHitCount > 99) {
+        } else {
+            lastDist = d;
+            lastStep = d * relaxation;
+            total_d += lastStep;
+        }
+        if (++noHitCount > 99) {
+            cappedRays++;
             return {
                 HIT_NONE,
                 origin,
@@ -173,14 +201,57 @@ Ray RayCast(Vec origin, Vec direction) {
     };
 }
 
-Vec UniformHemisphereSampler(Vec normal) {
-    Vec tangent = Vec(normal.y, -normal.x);
-    Vec bitangent = tangent.cross(normal);
+// 0 for hard sun shadows, otherwise rays that pass close to something
+// are darkened into a penumbra that gets wider as this gets smaller
+#define SUN_SOFTNESS 0
+
+// How much of the sun is visible along a ray: 0 if anything blocks it,
+// otherwise 1, or the penumbra factor with SUN_SOFTNESS. Marches like
+// RayCast but stops at the first hit without working out a normal.
+float SunVisibility(Vec origin, Vec direction) {
+    totalRays++;
+    int noHitCount = 0;
+    float relaxation = MARCH_RELAXATION;
+    float lastDist = 0;
+    float lastStep = 0;
+    float closestRatio = 1e9;
+    for (float total_d = 0; total_d < 100;) {
+        totalSteps++;
+        float d = Query(origin + direction * total_d).distance;
+        if (relaxation > 1 && fabsf(d) + lastDist < lastStep) {
+            total_d += lastDist - lastStep;
+            lastStep = lastDist;
+            relaxation = 1;
+        } else if (d < 0.01) {
+            return 0;
+        } else {
+            closestRatio = fminf(closestRatio, d / total_d);
+            lastDist = d;
+            lastStep = d * relaxation;
+            total_d += lastStep;
+        }
+        if (++noHitCount > 99) {
+            cappedRays++;
+            break;
+        }
+    }
+    return SUN_SOFTNESS > 0 ? fminf(1, SUN_SOFTNESS * closestRatio) : 1;
+}
 
-    float angle = 6.28318531 * random();
-    float height = random();
-    // Selects random unit vector in hemisphere of normal vector
-    return !(normal * height + tangent * cosf(angle) + bitangent * sinf(angle));
+// Random unit vector in the hemisphere of the normal, picked with density
+// cos / pi so that a Lambertian bounce's weight is just its reflectance
+Vec CosineHemisphereSampler(Vec normal, Sampler &sampler) {
+    // Orthonormal basis around the normal (Duff et al. 2017)
+    float sign = copysignf(1, normal.z);
+    float a = -1 / (sign + normal.z);
+    float b = normal.x * normal.y * a;
+    Vec tangent(1 + sign * normal.x * normal.x * a, sign * b, -sign * normal.x);
+    Vec bitangent(b, sign + normal.y * normal.y * a, -normal.y);
+
+    float u = sampler.next();
+    float angle = 6.28318531 * sampler.next();
+    float radius = sqrtf(u);
+    return tangent * (radius * cosf(angle)) + bitangent * (radius * sinf(angle)) + normal * sqrtf(1 - u);
 }
 
 bool HitReflective(int hitType) {
@@ -207,79 +278,92 @@ Vec GetReflectance(int hitType) {
 }
 
 #define BOUNCE_COUNT 12
-Vec TracePath(Vec origin, Vec direction, int depth=0) {
+// Bounce from which Russian roulette may end paths whose throughput has
+// dropped below 1
+#define RR_MIN_DEPTH 3
+
+// Follows a path one bounce at a time, keeping track of its throughput,
+// and returns the light it brings back. Bounce 0 of the sampler is left
+// to the camera.
+Vec TracePath(Vec origin, Vec direction, Sampler sampler) {
     Vec skyColor(1, 1, 1);
-
-    if (depth >= BOUNCE_COUNT) return Vec(0);
-
-    Ray hit = RayCast(origin, direction);
-    int hitType = hit.hitType;
-    Vec samplePosition = hit.origin + hit.direction * hit.traveled;
-
-    if (hitType == HIT_NONE) {
-        // Skybox color
-        return skyColor;
-    }
-
-    Vec normal = hit.normal;
     Vec lightDir = !Vec(-0.2, 0.4, -0.5);
 
-    // Calculate incoming light
-    float sunIncidence = normal % lightDir;
-    Vec incomingLight(0);
-    if (sunIncidence > 0) {
-        Ray sunHit = RayCast(samplePosition + hit.normal * 0.02, lightDir);
-        if (sunHit.hitType == HIT_NONE) {
-            incomingLight = Vec(1, 1, 1) * sunIncidence;
+    Vec radiance(0);
+    Vec throughput(1);
+    for (int depth = 0; depth < BOUNCE_COUNT; depth++) {
+        sampler.startBounce(depth + 1);
+        Ray hit = RayCast(origin, direction);
+        int hitType = hit.hitType;
+        Vec samplePosition = hit.origin + hit.direction * hit.traveled;
+
+        if (hitType == HIT_NONE) {
+            // Skybox color
+            radiance = radiance + throughput * skyColor;
+            break;
         }
-    }
-
-    if (hitType == HIT_FLOOR) {
-        // Lambertian diffuse material
-        Vec newDirection = UniformHemisphereSampler(normal);
-
-        // Checkerboard calculation
-        const float spacing = 1.;
-        const float quarterSpacing = spacing / 4.;
-        // Some weird math to determine which color the samplePosition should be
-        float cy = fmodf(fabsf(samplePosition.z) + quarterSpacing, spacing) / spacing * 2 - 1;
-        float cx = fmodf(fabsf(samplePosition.x) + quarterSpacing, spacing) / spacing * 2 - 1;
-        // Set color
-        Vec reflectance = cy * cx < 0 ? Vec(0.7) : Vec(1);
-
-        float cos_theta = newDirection % normal;
-        Vec brdf = reflectance * (1 / 3.1415926);
-
-        Vec newOrigin = samplePosition + normal * 0.1;
-        Vec incoming = TracePath(newOrigin, newDirection, depth + 1);
-        incoming = incoming + incomingLight;
 
-        return brdf * incoming * (cos_theta * 6.28318531);
-    }
-
-    if (HitReflective(hitType)) {
-        // Sharp reflective material
-        Vec newDirection = !(direction + normal * ((normal % direction) * -2));
-
-        Vec reflectance = GetReflectance(hitType);
+        Vec normal = hit.normal;
 
-        float cos_theta = newDirection % normal;
-        Vec brdf = reflectance * (1/ 3.1415926);
-
-        Vec newOrigin = samplePosition + normal * 0.1;
-        Vec incoming = TracePath(newOrigin, newDirection, depth + 1);
+        // Calculate incoming light
+        float sunIncidence = normal % lightDir;
+        Vec incomingLight(0);
+        if (sunIncidence > 0) {
+            float visibility = SunVisibility(samplePosition + hit.normal * 0.02, lightDir);
+            incomingLight = Vec(1, 1, 1) * (sunIncidence * visibility);
+        }
 
-        // Calculate specular highlight of the light
-        float lightAngle = acos(lightDir % normal);
-        float lightArgument = lightAngle / 0.01;
-        float lightStrength = exp(-lightArgument * lightArgument);
+        Vec newDirection;
+        Vec weight;
+        if (hitType == HIT_FLOOR) {
+            // Lambertian diffuse material
+            newDirection = CosineHemisphereSampler(normal, sampler);
+
+            // Checkerboard calculation
+            const float spacing = 1.;
+            const float quarterSpacing = spacing / 4.;
+            // Some weird math to determine which color the samplePosition should be
+            float cy = fmodf(fabsf(samplePosition.z) + quarterSpacing, spacing) / spacing * 2 - 1;
+            float cx = fmodf(fabsf(samplePosition.x) + quarterSpacing, spacing) / spacing * 2 - 1;
+            // Set color
+            Vec reflectance = cy * cx < 0 ? Vec(0.7) : Vec(1);
+
+            // brdf * cos / pdf, with brdf = reflectance / pi
+            weight = reflectance;
+            radiance = radiance + throughput * reflectance * incomingLight;
+        } else if (HitReflective(hitType)) {
+            // Sharp reflective material
+            newDirection = !(direction + normal * ((normal % direction) * -2));
+
+            Vec reflectance = GetReflectance(hitType);
+            Vec brdf = reflectance * (1/ 3.1415926);
+
+            // Calculate specular highlight of the light
+            float lightAngle = acos(lightDir % normal);
+            float lightArgument = lightAngle / 0.01;
+            float lightStrength = exp(-lightArgument * lightArgument);
+
+            weight = brdf * (0.5 * 6.28318531);
+            radiance = radiance + throughput * weight * (incomingLight * lightStrength);
+        } else {
+            break;
+        }
 
-        incoming = incoming + (incomingLight * lightStrength);
+        throughput = throughput * weight;
+        if (depth >= RR_MIN_DEPTH) {
+            // Russian roulette: end the path with probability 1 - throughput
+            // and weight up the ones that go on, so the estimate stays unbiased
+            float survival = fmaxf(throughput.x, fmaxf(throughput.y, throughput.z));
+            if (survival < 1) {
+                if (sampler.next() >= survival) break;
+                throughput = throughput * (1 / survival);
+            }
+        }
 
-        return brdf * incoming * (0.5 * 6.28318531);
+        origin = samplePosition + normal * 0.1;
+        direction = newDirection;
     }
-
-    return Vec(0);
+    return radiance;
 }
 
 uint64_t GetMicros() {
@@ -298,6 +382,24 @@ Vec GetCameraRay(float x, float y, const float w, const float h, const float fov
     return !(rayTarget + origin * -1);
 }
 
+// Run the equal-time convergence test in Convergence.hpp instead of a
+// single render. The reference gets CONVERGENCE_REFERENCE_SAMPLES paths
+// per pixel, and then CONVERGENCE_BATCH paths per pixel are added at a
+// time for CONVERGENCE_SECONDS.
+#define CONVERGENCE 0
+#define CONVERGENCE_REFERENCE_SAMPLES 1024
+#define CONVERGENCE_BATCH 1
+#define CONVERGENCE_SECONDS 60
+
+// Render CHECKPOINT_BATCH paths per pixel at a time and save the sums to
+// CHECKPOINT_FILE when CHECKPOINT_SECONDS have passed since the last
+// save. A render that finds a checkpoint with the same settings goes on
+// from there, and deletes it once the image is written.
+#define CHECKPOINT 0
+#define CHECKPOINT_FILE "tracer2.checkpoint"
+#define CHECKPOINT_SECONDS 60
+#define CHECKPOINT_BATCH 1
+
 int main() {
     const int w = 1920 * 0.2;
     const int h = 1080 * 0.2;
@@ -306,47 +408,117 @@ int main() {
     const float aperture = 0.08;
     const float focal_length = 2.7; // Distance from camera to sphere
     const float fov = 30.;
+    const uint32_t seed = 0;
+    const SampleSequence sequence = SEQUENCE_SOBOL;
 
     Vec position(-0.87731, 0.16249, -2.67723);
     Vec target = !Vec(0.38, 0.15, 1);
     Vec up = Vec(0, 1, 0);
     Vec right = target.cross(up);
 
-    FILE *fp;
-    errno_t err = fopen_s(&fp, "tracer2.ppm", "wb");
-    if (err != 0) {
-        return -1;
+    std::vector<unsigned char> pixels(w * h * 3);
+    // Radiance summed over the paths so far, rows top to bottom
+    std::vector<Vec> sums(w * h);
+
+    // Adds paths first to first + count - 1 of every pixel to its sum
+    auto renderSamples = [&](int first, int count, uint32_t seed) {
+        for (int y = h; y--;) {
+            for (int x = 0; x < w; x++) {
+                Vec &color = sums[(h - 1 - y) * w + x];
+                Sampler pixelSampler(x + y * w, seed, sequence);
+
+                for (int p = first; p < first + count; p++) {
+                    Sampler sampler = pixelSampler.split(p, samples);
+                    // Jitter within the pixel
+                    float jx = sampler.next() - 0.5f;
+                    float jy = sampler.next() - 0.5f;
+                    // Camera space ray
+                    Vec cd = GetCameraRay((float)(w - x) + jx, (float)y + jy, (float)w, (float)h, fov);
+                    // World space ray
+                    Vec direction = !(right * cd.x + up * cd.y + target * -cd.z);
+
+                    // Focal point
+                    Vec focal_point = position + direction * focal_length;
+
+                    // Randomly offset origin
+                    float lx = sampler.next() - 0.5f;
+                    float ly = sampler.next() - 0.5f;
+                    Vec origin = position + right * (lx * aperture) + up * (ly * aperture);
+                    Vec dir = !(focal_point + origin * -1);
+                    color = color + TracePath(origin, dir, sampler);
+                }
+            }
+        }
+    };
+
+    if (CONVERGENCE) {
+        int rendered = 0;
+        auto reference = [&](float *rgb) {
+            renderSamples(0, CONVERGENCE_REFERENCE_SAMPLES, seed + 1);
+            for (int i = 0; i < w * h; i++) {
+                Vec color = sums[i] * (1. / CONVERGENCE_REFERENCE_SAMPLES);
+                rgb[i * 3] = color.x;
+                rgb[i * 3 + 1] = color.y;
+                rgb[i * 3 + 2] = color.z;
+                sums[i] = Vec();
+            }
+        };
+        auto batch = [&](float *rgb) {
+            renderSamples(rendered, CONVERGENCE_BATCH, seed);
+            rendered += CONVERGENCE_BATCH;
+            for (int i = 0; i < w * h; i++) {
+                Vec color = sums[i] * (1. / rendered);
+                rgb[i * 3] = color.x;
+                rgb[i * 3 + 1] = color.y;
+                rgb[i * 3 + 2] = color.z;
+            }
+            return (float)rendered;
+        };
+        return RunConvergence("tracer2", w, h, CONVERGENCE_SECONDS, reference, batch) ? 1 : 0;
     }
-    fprintf(fp, "P6 %d %d 255\n", w, h);
 
     uint64_t start = GetMicros();
-    for (int y = h; y--;) {
-        for (int x = 0; x < w; x++) {
-            Vec color;
-            // Camera space ray
-            Vec cd = GetCameraRay((float)(w - x), (float)y, (float)w, (float)h, fov);
-            // World space ray
-            Vec direction = !(right * cd.x + up * cd.y + target * -cd.z);
-
-            // Focal point
-            Vec focal_point = position + direction * focal_length;
-
-            for (int p = 0; p < samples; p++) {
-                // Randomly offset origin
-                Vec origin = position + right * ((random() - 0.5) * aperture) + up * ((random() - 0.5) * aperture);
-                Vec dir = !(focal_point + origin * -1);
-                color = color + TracePath(origin, dir);
+    if (CHECKPOINT) {
+        int rendered = 0;
+        // Everything the radiance depends on
+        uint64_t key = CheckpointKey({ (uint64_t)w, (uint64_t)h, (uint64_t)samples, seed, (uint64_t)sequence,
+            BOUNCE_COUNT, RR_MIN_DEPTH, CheckpointBits(MARCH_RELAXATION), CheckpointBits(SUN_SOFTNESS),
+            CheckpointBits(aperture), CheckpointBits(focal_length), CheckpointBits(fov),
+            CheckpointBits(position.x), CheckpointBits(position.y), CheckpointBits(position.z),
+            CheckpointBits(target.x), CheckpointBits(target.y), CheckpointBits(target.z) });
+        std::vector<CheckpointSection> state = { { sums.data(), sums.size() * sizeof(Vec) }, { &rendered, sizeof(rendered) } };
+        if (ReadCheckpoint(CHECKPOINT_FILE, key, state)) printf("Resuming with %d of %d samples per pixel done.\n", rendered, samples);
+        uint64_t saved = GetMicros();
+        while (rendered < samples) {
+            int count = samples - rendered < CHECKPOINT_BATCH ? samples - rendered : CHECKPOINT_BATCH;
+            renderSamples(rendered, count, seed);
+            rendered += count;
+            if (rendered < samples && GetMicros() - saved >= CHECKPOINT_SECONDS * 1e6) {
+                if (!WriteCheckpoint(CHECKPOINT_FILE, key, state)) printf("Failed to write %s.\n", CHECKPOINT_FILE);
+                saved = GetMicros();
             }
-            color = color * (1. / samples) * 255;
-            color = color.limit(255);
-            fprintf(fp, "%c%c%c",(int)color.x, (int)color.y, (int)color.z);
         }
+    } else {
+        renderSamples(0, samples, seed);
+    }
+    for (int i = 0; i < w * h; i++) {
+        Vec color = sums[i] * (1. / samples) * 255;
+        color = color.limit(255);
+        pixels[i * 3] = (int)color.x;
+        pixels[i * 3 + 1] = (int)color.y;
+        pixels[i * 3 + 2] = (int)color.z;
     }
     uint64_t end = GetMicros();
-    fclose(fp);
+    if (!WriteImage("tracer2.ppm", pixels.data(), w, h)) {
+        printf("Failed to write tracer2.ppm");
+        return -1;
+    }
+    if (CHECKPOINT) remove(CHECKPOINT_FILE);
 
     float dtime = (float)(end - start) / 1e6;
-    printf("Casted %" PRIu64 " rays in %f seconds @ %f rays per second", totalRays, dtime, (float)totalRays / dtime);
+    printf("Casted %" PRIu64 " rays in %f seconds @ %f rays per second\n", totalRays, dtime, (float)totalRays / dtime);
+    printf("%" PRIu64 " rays hit the step cap", cappedRays);
+    WriteBenchmark({ "tracer2", w, h, (float)samples, (end - start) / 1e6, totalRays, totalSteps, totalEvaluations });
 
     return 0;
 }
\ No newline at end of file